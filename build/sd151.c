@@ -48,6 +48,31 @@ static struct sd151_private *pdata;
 extern int sd151_proc_init(struct sd151_private *);
 extern int sd151_proc_remove(struct sd151_private *);
 extern int sd151_wdog_init(struct sd151_private *);
+extern int sd151_wdog_remove(struct sd151_private *);
+extern int sd151_button_init(struct device *, struct sd151_private *);
+extern void sd151_button_remove(struct sd151_private *);
+extern void sd151_button_event(struct sd151_private *, int, bool);
+extern void sd151_bus_init(struct sd151_private *);
+extern int sd151_bus_get(struct sd151_private *, int);
+extern void sd151_bus_put(struct sd151_private *);
+extern int sd151_bus_read(struct sd151_private *, int, unsigned int,
+	unsigned int *);
+extern int sd151_bus_write(struct sd151_private *, int, unsigned int,
+	unsigned int);
+extern int sd151_bus_bulk_read(struct sd151_private *, int, unsigned int,
+	void *, size_t);
+extern int sd151_bus_bulk_write(struct sd151_private *, int, unsigned int,
+	const void *, size_t);
+extern void sd151_updi_init(struct sd151_private *);
+extern void sd151_updi_remove(struct sd151_private *);
+#ifdef CONFIG_SD151_TEST
+extern bool sd151_stub_enabled;
+extern struct regmap *sd151_stub_regmap_init(struct i2c_client *,
+	const struct regmap_config *);
+#else
+/* The register model is only built in the test configuration */
+#define sd151_stub_enabled              false
+#endif
 
 extern const struct hwmon_chip_info sd151_chip_info;
 
@@ -76,7 +101,7 @@ int sd151_write_command(struct sd151_private *data, unsigned int cmd)
 {
 	int ret;
 
-	ret = regmap_write(data->regmap, SD151_COMMAND, cmd);
+	ret = sd151_bus_write(data, SD151_BUS_INTERACTIVE, SD151_COMMAND, cmd);
 
 	if (ret<0) {
 		dev_err(data->dev, "failed to write command %x\n",cmd);
@@ -99,7 +124,7 @@ int sd151_write_register(struct sd151_private *data, int reg, unsigned int cmd)
 {
 	int ret;
 
-	ret = regmap_write(data->regmap, reg, cmd);
+	ret = sd151_bus_write(data, SD151_BUS_INTERACTIVE, reg, cmd);
 
 	if (ret<0) {
 		dev_err(data->dev, "failed to write register %x\n",reg);
@@ -111,6 +136,67 @@ int sd151_write_register(struct sd151_private *data, int reg, unsigned int cmd)
 
 EXPORT_SYMBOL_GPL(sd151_write_register);
 
+/*****************************************************************************
+ * BUS SELF-TEST
+ *************************************************************************** */
+
+/**
+ * @brief Run a read/verify burst on the chip ID and version registers
+ * @param [in] data struct sd151_private pointer
+ * @param [in] count number of transfers
+ * @return 0 when every transfer returned the expected value.
+ * @details The result, latency and error counts are kept in data->selftest
+ * and reported in /proc/sd151; test/sd151-i2c-tune.sh uses it to select the
+ * fastest reliable bus clock.
+ */
+int sd151_selftest(struct sd151_private *data, unsigned int count)
+{
+	struct sd151_selftest st;
+	unsigned int reg, expect, val, i;
+	u64 t0, ns;
+	int ret;
+
+	memset(&st, 0, sizeof(st));
+	st.min_ns = U64_MAX;
+
+	for (i = 0; i < count; i++) {
+		reg = (i & 1) ? SD151_CHIP_VER_REG : SD151_CHIP_ID_REG;
+		expect = (i & 1) ? data->firmware_version : SD151_CHIP_ID;
+
+		/* Time the transfer only, not the wait for the bus */
+		if (sd151_bus_get(data, SD151_BUS_BULK))
+			return -EBUSY;
+		t0 = ktime_get_ns();
+		ret = regmap_read(data->regmap, reg, &val);
+		ns = ktime_get_ns() - t0;
+		sd151_bus_put(data);
+
+		st.count++;
+		if (ret < 0) {
+			st.errors++;
+			continue;
+		}
+		if (val != expect)
+			st.mismatches++;
+
+		st.total_ns += ns;
+		st.min_ns = min(st.min_ns, ns);
+		st.max_ns = max(st.max_ns, ns);
+	}
+
+	if (st.min_ns == U64_MAX)
+		st.min_ns = 0;
+
+	data->selftest = st;
+
+	dev_info(data->dev, "selftest at %u Hz: %u xfers, %u errors, %u bad values\n",
+		data->bus_hz, st.count, st.errors, st.mismatches);
+
+	return (st.errors || st.mismatches) ? -EIO : 0;
+}
+
+EXPORT_SYMBOL_GPL(sd151_selftest);
+
 /*****************************************************************************
  * INPUT DEVICE
  *************************************************************************** */
@@ -132,20 +218,25 @@ static void sd151_irq_work_handler(struct work_struct *work)
 	int i,curr,prev,pwr;
 
 	/* get the chip status */
-	ret = regmap_read(priv->regmap, SD151_STATUS, &val);
+	ret = sd151_bus_read(priv, SD151_BUS_INTERACTIVE, SD151_STATUS, &val);
 	if (ret < 0) {
 		dev_err(dev, "failed to read I2C chip status\n");
 		return;
 	}
 
 	/* clear irq */
-	ret = regmap_write(priv->regmap, SD151_COMMAND,	SD151_IRQ_ACKNOWLEDGE);
+	ret = sd151_bus_write(priv, SD151_BUS_INTERACTIVE, SD151_COMMAND,
+		SD151_IRQ_ACKNOWLEDGE);
 	if (ret < 0) {
 		dev_err(dev, "failed to write I2C command\n");
 	}
 
+	/* Any chip interrupt is a chance to check a running RTC alarm */
+	if (priv->alarm_enabled)
+		schedule_work(&priv->alarm_work);
+
 	if (val&SD151_STATUS_IRQ_BUTTONS) {
-		ret = regmap_read(priv->regmap, SD151_BUTTONS, &val);
+		ret = sd151_bus_read(priv, SD151_BUS_INTERACTIVE, SD151_BUTTONS, &val);
 		if (ret < 0) {
 			dev_err(dev, "failed to read I2C buttons\n");
 			return;
@@ -159,7 +250,9 @@ static void sd151_irq_work_handler(struct work_struct *work)
 
 		for (i=0; i<NBUTTON; i++) {
 			if ((curr&1)!=(prev&1)) {
-				if (pwr&1) {
+				if (priv->inp.gestures) {
+					sd151_button_event(priv, i, curr&1);
+				} else if (pwr&1) {
 					input_report_key(priv->inp.button_dev, KEY_POWER, curr&1);
 				} else {
 					input_report_key(priv->inp.button_dev, BTN_0+i, curr&1);
@@ -177,83 +270,593 @@ static void sd151_irq_work_handler(struct work_struct *work)
 
 
 /****************************************************************************
- * RTC OPS
+ * RTC 48 BIT ACCESS
  ****************************************************************************/
 
-static int sd151_rtc_set_time(struct device *dev, struct rtc_time *tm)
+#define SD151_RTC_WORDS                 3
+#define SD151_RTC_MAX_READS             3
+
+/**
+ * @brief Transfer the 3 words of a 48 bit RTC value
+ * @param [in] data struct sd151_private pointer
+ * @param [in] reg first word register (SD151_RTC0 or SD151_WAKEUP0)
+ * @param [in,out] w words buffer
+ * @param [in] write true to write the words
+ * @return 0 on success.
+ * @details The words are moved with a single block transfer. If the firmware
+ * does not support block transfers (see sd151_rtc_probe_block) or refuses
+ * one, the driver falls back to one transfer per word.
+ */
+static int sd151_rtc_xfer(struct sd151_private *data, unsigned int reg,
+	u16 *w, bool write)
 {
- 	struct sd151_private *data = dev_get_drvdata(dev);
- 	time64_t new_time = rtc_tm_to_time64(tm);
-	int ret;
 	unsigned int tick;
+	int ret;
+	int i;
 
-	if (new_time > 0x0000ffffffffffff)
- 		return -EINVAL;
+	if (!data->rtc_word_io) {
+		if (write)
+			ret = sd151_bus_bulk_write(data, SD151_BUS_INTERACTIVE, reg, w,
+				SD151_RTC_WORDS);
+		else
+			ret = sd151_bus_bulk_read(data, SD151_BUS_INTERACTIVE, reg, w,
+				SD151_RTC_WORDS);
+		if (!ret)
+			return 0;
+		dev_warn(data->dev, "RTC block transfer failed, using word access\n");
+		data->rtc_word_io = true;
+	}
 
- 	/*
- 	 * The value to write is divided in 3 words of 16 bits
- 	 * and written into the sd151 firmware
- 	 */
+	for (i = 0; i < SD151_RTC_WORDS; i++) {
+		if (write) {
+			ret = sd151_bus_write(data, SD151_BUS_INTERACTIVE, reg + i, w[i]);
+		} else {
+			ret = sd151_bus_read(data, SD151_BUS_INTERACTIVE, reg + i, &tick);
+			w[i] = tick & 0xffff;
+		}
+		if (ret)
+			return ret;
+	}
 
-	tick = new_time & 0xffff;
-	ret = regmap_write(data->regmap, SD151_RTC0,	tick);
-	if (ret) {
-		dev_err(dev, "Unable to write RTC word 0 when setting time\n");
-		return ret;
+	return 0;
+}
+
+/**
+ * @brief Check once that block reads return consecutive registers
+ * @param [in] data struct sd151_private pointer
+ * @return None
+ * @details A firmware that does not auto-increment the register address
+ * accepts the block read but repeats the first register. The chip ID and the
+ * version are read both ways and must agree, otherwise the RTC values are
+ * always moved one word at a time.
+ */
+static void sd151_rtc_probe_block(struct sd151_private *data)
+{
+	u16 w[SD151_RTC_WORDS];
+	unsigned int id, ver;
+
+	if (sd151_bus_read(data, SD151_BUS_INTERACTIVE, SD151_CHIP_ID_REG, &id) ||
+	    sd151_bus_read(data, SD151_BUS_INTERACTIVE, SD151_CHIP_VER_REG, &ver))
+		return;
+
+	if (sd151_bus_bulk_read(data, SD151_BUS_INTERACTIVE, SD151_CHIP_ID_REG, w,
+			SD151_RTC_WORDS) || w[0] != id || w[1] != ver) {
+		dev_info(data->dev, "no register block reads, RTC uses word access\n");
+		data->rtc_word_io = true;
 	}
+}
 
-	tick = (new_time>>16) & 0xffff;
-	ret = regmap_write(data->regmap, SD151_RTC1,	tick);
-	if (ret) {
-		dev_err(dev, "Unable to write RTC word 1 when setting time\n");
+/**
+ * @brief Read a 48 bit RTC value
+ * @param [in] data struct sd151_private pointer
+ * @param [in] reg first word register (SD151_RTC0 or SD151_WAKEUP0)
+ * @param [out] value read value
+ * @return 0 on success.
+ * @details The running counter can only tear when a carry out of its lowest
+ * byte happens during the transfer, so it is read again only when the lowest
+ * byte is 0x00 or 0xff, until two consecutive reads agree.
+ */
+static int sd151_rtc_read48(struct sd151_private *data, unsigned int reg,
+	time64_t *value)
+{
+	u16 w[SD151_RTC_WORDS];
+	u16 prev[SD151_RTC_WORDS];
+	u8 low;
+	int ret;
+	int i;
+
+	ret = sd151_rtc_xfer(data, reg, w, false);
+	if (ret)
 		return ret;
+
+	for (i = 1; reg == SD151_RTC0 && i < SD151_RTC_MAX_READS; i++) {
+		low = w[0] & 0xff;
+		if (low != 0x00 && low != 0xff)
+			break;
+		memcpy(prev, w, sizeof(w));
+		ret = sd151_rtc_xfer(data, reg, w, false);
+		if (ret)
+			return ret;
+		if (!memcmp(w, prev, sizeof(w)))
+			break;
 	}
 
-	tick = (new_time>>32) & 0xffff;
-	ret = regmap_write(data->regmap, SD151_RTC2,	tick);
-	if (ret) {
-		dev_err(dev, "Unable to write RTC word 2 when setting time\n");
+	*value = (time64_t)w[0] | ((time64_t)w[1] << 16) | ((time64_t)w[2] << 32);
+
+	return 0;
+}
+
+/**
+ * @brief Write a 48 bit RTC value
+ * @param [in] data struct sd151_private pointer
+ * @param [in] reg first word register (SD151_RTC0 or SD151_WAKEUP0)
+ * @param [in] value value to write
+ * @return 0 on success.
+ */
+static int sd151_rtc_write48(struct sd151_private *data, unsigned int reg,
+	time64_t value)
+{
+	u16 w[SD151_RTC_WORDS];
+
+	if (value < 0 || value > 0x0000ffffffffffff)
+		return -EINVAL;
+
+	w[0] = value & 0xffff;
+	w[1] = (value >> 16) & 0xffff;
+	w[2] = (value >> 32) & 0xffff;
+
+	return sd151_rtc_xfer(data, reg, w, true);
+}
+
+/****************************************************************************
+ * RTC EXTRAPOLATION
+ ****************************************************************************/
+
+/*
+ * The firmware counter ticks at 1 Hz, so reads are served from an anchor:
+ * the boottime instant (edge) when the counter became secs. The true edge
+ * lies in [edge - err_ns, edge]; every hardware read narrows this window.
+ * The counter may run faster or slower than boottime by SD151_RTC_MAX_PPM,
+ * so the window widens by the drift margin on both sides as time passes.
+ * A read is answered without I2C traffic only when the whole window maps to
+ * the same second.
+ */
+#define SD151_RTC_MAX_PPM               200
+#define SD151_RTC_REF_ERR_NS            (10 * NSEC_PER_MSEC)
+#define SD151_RTC_DRIFT_SPAN_NS         (60LL * NSEC_PER_SEC)
+
+static s64 sd151_rtc_drift_margin(s64 elapsed)
+{
+	return div_s64(elapsed, 1000000 / SD151_RTC_MAX_PPM);
+}
+
+/**
+ * @brief Extrapolate the RTC counter from the anchor
+ * @param [in] data struct sd151_private pointer
+ * @param [out] value counter value
+ * @return true if the value could be extrapolated without doubt.
+ */
+static bool sd151_rtc_predict(struct sd151_private *data, time64_t *value)
+{
+	struct sd151_rtc_cache *c = &data->rtc_cache;
+	s64 elapsed, drift, lo, hi;
+
+	if (!c->valid || !c->resync_ms)
+		return false;
+
+	elapsed = ktime_to_ns(ktime_sub(ktime_get_boottime(), c->edge));
+	if (elapsed < 0 || elapsed > (s64)c->resync_ms * NSEC_PER_MSEC)
+		return false;
+
+	/* Counter time since the true edge, slow or fast counter */
+	drift = sd151_rtc_drift_margin(elapsed);
+	lo = elapsed - drift;
+	hi = elapsed + c->err_ns + drift;
+	if (lo < 0 || div_s64(lo, NSEC_PER_SEC) != div_s64(hi, NSEC_PER_SEC))
+		return false;
+
+	*value = c->secs + div_s64(lo, NSEC_PER_SEC);
+	c->cached_reads++;
+
+	return true;
+}
+
+void sd151_reset_check(struct sd151_private *data);
+
+/* Also used by the RTC reads, a counter that went back is a firmware reset */
+#define SD151_RESET_RTC_TOLERANCE_S     2
+
+/**
+ * @brief Read the RTC counter from hardware and refine the anchor
+ * @param [in] data struct sd151_private pointer
+ * @param [out] value counter value
+ * @return 0 on success.
+ */
+static int sd151_rtc_sync(struct sd151_private *data, time64_t *value)
+{
+	struct sd151_rtc_cache *c = &data->rtc_cache;
+	ktime_t before, after, lo, hi, phi;
+	time64_t v;
+	s64 span, drift;
+	int ret;
+
+	before = ktime_get_boottime();
+	ret = sd151_rtc_read48(data, SD151_RTC0, &v);
+	after = ktime_get_boottime();
+	if (ret)
 		return ret;
+
+	c->hw_reads++;
+
+	if (c->valid && v + SD151_RESET_RTC_TOLERANCE_S < c->secs) {
+		/*
+		 * The counter went back without set_time: a firmware reset. The
+		 * anchor is kept for sd151_reset_restore_rtc(), the time is
+		 * extrapolated from it meanwhile.
+		 */
+		sd151_reset_check(data);
+		*value = c->secs + div_s64(ktime_to_ns(ktime_sub(after, c->edge)),
+			NSEC_PER_SEC);
+		return 0;
 	}
 
- 	return 0;
- }
+	*value = v;
+
+	/* The counter became v somewhere in (before - 1s, after] */
+	lo = ktime_sub_ns(before, NSEC_PER_SEC);
+	hi = after;
+
+	if (c->valid && v >= c->secs && v - c->secs < S32_MAX) {
+		/*
+		 * Intersect with the previous window moved forward to v, widened
+		 * by the drift on both sides
+		 */
+		phi = ktime_add_ns(c->edge, (u64)(v - c->secs) * NSEC_PER_SEC);
+		drift = sd151_rtc_drift_margin(ktime_to_ns(ktime_sub(after, c->edge)));
+		lo = max(lo, ktime_sub_ns(phi, c->err_ns + drift));
+		hi = min(hi, ktime_add_ns(phi, drift));
+	}
 
-static int sd151_rtc_read_time(struct device *dev, struct rtc_time *tm)
+	if (ktime_after(lo, hi)) {
+		/* Counter stepped or drifted out of bounds: start again */
+		c->mismatches++;
+		c->ref_valid = false;
+		lo = ktime_sub_ns(before, NSEC_PER_SEC);
+		hi = after;
+	}
+
+	c->edge = hi;
+	c->err_ns = ktime_to_ns(ktime_sub(hi, lo));
+	c->secs = v;
+	c->valid = true;
+
+	if (c->err_ns > SD151_RTC_REF_ERR_NS)
+		return 0;
+
+	/* Measure the counter rate against boottime over a long span */
+	if (!c->ref_valid) {
+		c->ref_edge = c->edge;
+		c->ref_secs = c->secs;
+		c->ref_valid = true;
+	} else {
+		span = ktime_to_ns(ktime_sub(c->edge, c->ref_edge));
+		if (span >= SD151_RTC_DRIFT_SPAN_NS)
+			c->drift_ppb = div64_s64(((s64)(c->secs - c->ref_secs) *
+				NSEC_PER_SEC - span) * NSEC_PER_SEC, span);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Get the RTC counter, extrapolated when possible
+ * @param [in] data struct sd151_private pointer
+ * @param [out] now counter value
+ * @return 0 on success.
+ */
+static int sd151_rtc_now(struct sd151_private *data, time64_t *now)
 {
-	struct sd151_private *data = dev_get_drvdata(dev);
-	time64_t new_time,snap_time;
- 	int ret;
- 	unsigned int tick;
+	if (sd151_rtc_predict(data, now))
+		return 0;
 
-	/*
-	* The value to read is divided in 3 words of 16 bits
-	* and read from the sd151 firmware
-	*/
+	return sd151_rtc_sync(data, now);
+}
 
-	ret = regmap_read(data->regmap, SD151_RTC0,	&tick);
-	if (ret) {
-		dev_err(dev, "Unable to read RTC word 0 when getting time\n");
+/****************************************************************************
+ * RTC RUNTIME ALARM
+ ****************************************************************************/
+
+/*
+ * The firmware only uses the WAKEUP registers to power the board on, it does
+ * not signal the alarm while running. Runtime alarms (RTC_AIE and the update
+ * interrupts emulated by the RTC core on top of them) are timed on the host,
+ * aligned on the firmware second edge, and confirmed on the hardware counter
+ * before rtc_update_irq() is raised. Update interrupts never reach the
+ * WAKEUP registers, see sd151_rtc_wake_sync().
+ */
+#define SD151_RTC_ALARM_MAX_S           86400
+
+static void sd151_rtc_alarm_arm(struct sd151_private *data, time64_t now)
+{
+	struct sd151_rtc_cache *c = &data->rtc_cache;
+	time64_t delta = data->alarm_time - now;
+	ktime_t expires;
+
+	if (delta <= 0) {
+		schedule_work(&data->alarm_work);
+		return;
+	}
+
+	/* Far alarms are checked again once a day */
+	if (delta > SD151_RTC_ALARM_MAX_S)
+		delta = SD151_RTC_ALARM_MAX_S;
+
+	if (c->valid && data->alarm_time - c->secs <= SD151_RTC_ALARM_MAX_S)
+		expires = ktime_add_ns(c->edge,
+			(u64)(data->alarm_time - c->secs) * NSEC_PER_SEC);
+	else
+		expires = ktime_add_ns(ktime_get_boottime(), (u64)delta * NSEC_PER_SEC);
+
+	hrtimer_start(&data->alarm_timer, expires, HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart sd151_rtc_alarm_expired(struct hrtimer *timer)
+{
+	struct sd151_private *data = container_of(timer, struct sd151_private,
+		alarm_timer);
+
+	schedule_work(&data->alarm_work);
+
+	return HRTIMER_NORESTART;
+}
+
+static void sd151_rtc_alarm_work(struct work_struct *work)
+{
+	struct sd151_private *data = container_of(work, struct sd151_private,
+		alarm_work);
+	time64_t now;
+	bool fire = false;
+
+	mutex_lock(&data->rtc_lock);
+
+	if (data->alarm_enabled && !data->alarm_pending &&
+	    !sd151_rtc_now(data, &now)) {
+		if (now >= data->alarm_time) {
+			data->alarm_pending = true;
+			fire = true;
+		} else {
+			sd151_rtc_alarm_arm(data, now);
+		}
+	}
+
+	mutex_unlock(&data->rtc_lock);
+
+	if (fire)
+		rtc_update_irq(data->rtc, 1, RTC_AF | RTC_IRQF);
+}
+
+/****************************************************************************
+ * RTC WAKE QUEUE
+ ****************************************************************************/
+
+/*
+ * The firmware has a single wakeup slot. Wake requests from several clients
+ * (the RTC core alarm as SD151_WAKE_RTC, and names written to /proc/sd151)
+ * are kept in a timerqueue and only the earliest future one is programmed.
+ * The WAKEUP registers are written only when that value changes.
+ * All functions are called with rtc_lock held.
+ */
+
+static struct sd151_wake *sd151_wake_find(struct sd151_private *data,
+	const char *name)
+{
+	struct sd151_wake *wake;
+
+	list_for_each_entry(wake, &data->wake_list, list) {
+		if (!strcmp(wake->name, name))
+			return wake;
+	}
+
+	return NULL;
+}
+
+static void sd151_wake_free(struct sd151_private *data, struct sd151_wake *wake)
+{
+	timerqueue_del(&data->wake_queue, &wake->node);
+	list_del(&wake->list);
+	data->wake_count--;
+	kfree(wake);
+}
+
+/**
+ * @brief Program the earliest wake request into the firmware
+ * @param [in] data struct sd151_private pointer
+ * @return 0 on success.
+ * @details Expired client requests are dropped, the RTC core alarm is left
+ * to the RTC core. Nothing is written when the slot already holds the value.
+ */
+static int sd151_wake_program(struct sd151_private *data)
+{
+	struct timerqueue_node *node, *next;
+	struct sd151_wake *wake;
+	time64_t target = 0;
+	time64_t now;
+	int ret;
+
+	ret = sd151_rtc_now(data, &now);
+	if (ret)
 		return ret;
+
+	for (node = timerqueue_getnext(&data->wake_queue); node; node = next) {
+		next = timerqueue_iterate_next(node);
+		if (node->expires > now) {
+			target = node->expires;
+			break;
+		}
+		wake = container_of(node, struct sd151_wake, node);
+		if (strcmp(wake->name, SD151_WAKE_RTC))
+			sd151_wake_free(data, wake);
 	}
-	snap_time = tick&0xffff;
-	new_time = snap_time;
 
-	ret = regmap_read(data->regmap, SD151_RTC1,	&tick);
-	if (ret) {
-		dev_err(dev, "Unable to read RTC word 1 when getting time\n");
+	if (data->wakeup_hw_valid && data->wakeup_hw == target) {
+		data->wakeup_skipped++;
+		return 0;
+	}
+
+	data->wakeup_hw_valid = false;
+	ret = sd151_rtc_write48(data, SD151_WAKEUP0, target);
+	if (ret)
 		return ret;
+
+	data->wakeup_hw = target;
+	data->wakeup_hw_valid = true;
+	data->wakeup_writes++;
+
+	return 0;
+}
+
+static int sd151_wake_add(struct sd151_private *data, const char *name,
+	time64_t time)
+{
+	struct sd151_wake *wake = sd151_wake_find(data, name);
+
+	if (time < 0 || time > 0x0000ffffffffffff)
+		return -EINVAL;
+
+	if (wake) {
+		timerqueue_del(&data->wake_queue, &wake->node);
+	} else {
+		if (data->wake_count >= SD151_WAKE_MAX)
+			return -ENOSPC;
+		wake = kzalloc(sizeof(*wake), GFP_KERNEL);
+		if (!wake)
+			return -ENOMEM;
+		strscpy(wake->name, name, sizeof(wake->name));
+		timerqueue_init(&wake->node);
+		list_add_tail(&wake->list, &data->wake_list);
+		data->wake_count++;
 	}
-	snap_time = tick&0xffff;
-	new_time = new_time | (snap_time<<16);
 
-	ret = regmap_read(data->regmap, SD151_RTC2,	&tick);
+	wake->node.expires = time;
+	timerqueue_add(&data->wake_queue, &wake->node);
+
+	return sd151_wake_program(data);
+}
+
+static int sd151_wake_del(struct sd151_private *data, const char *name)
+{
+	struct sd151_wake *wake = sd151_wake_find(data, name);
+
+	if (!wake)
+		return 0;
+
+	sd151_wake_free(data, wake);
+
+	return sd151_wake_program(data);
+}
+
+/**
+ * @brief Follow the RTC core user alarm in the wake queue
+ * @param [in] data struct sd151_private pointer
+ * @return 0 on success.
+ * @details set_alarm receives the earliest RTC core timer, which is the next
+ * second while update interrupts are emulated. Only the user alarm (the core
+ * aie_timer) is a power-on wakeup, so the slot follows it and the other timers
+ * are served by the host hrtimer alone. Called with the core ops_lock held.
+ */
+static int sd151_rtc_wake_sync(struct sd151_private *data)
+{
+	struct rtc_timer *aie;
+
+	if (IS_ERR_OR_NULL(data->rtc))
+		return 0;
+
+	aie = &data->rtc->aie_timer;
+	if (!aie->enabled)
+		return sd151_wake_del(data, SD151_WAKE_RTC);
+
+	return sd151_wake_add(data, SD151_WAKE_RTC,
+		ktime_divns(aie->node.expires, NSEC_PER_SEC));
+}
+
+/**
+ * @brief Add, move or cancel a named wake request
+ * @param [in] data struct sd151_private pointer
+ * @param [in] name client name
+ * @param [in] time RTC seconds, 0 cancels the request
+ * @param [in] relative time is relative to the current RTC time
+ * @return 0 on success.
+ */
+int sd151_wake_set(struct sd151_private *data, const char *name, time64_t time,
+	bool relative)
+{
+	time64_t now;
+	int ret;
+
+	if (IS_ERR_OR_NULL(data->rtc))
+		return -ENODEV;
+
+	if (!strcmp(name, SD151_WAKE_RTC))
+		return -EPERM;
+
+	mutex_lock(&data->rtc_lock);
+	if (!time) {
+		ret = sd151_wake_del(data, name);
+	} else if (relative) {
+		ret = sd151_rtc_now(data, &now);
+		if (!ret)
+			ret = sd151_wake_add(data, name, now + time);
+	} else {
+		ret = sd151_wake_add(data, name, time);
+	}
+	mutex_unlock(&data->rtc_lock);
+
+	return ret;
+}
+
+EXPORT_SYMBOL_GPL(sd151_wake_set);
+
+/****************************************************************************
+ * RTC OPS
+ ****************************************************************************/
+
+static int sd151_rtc_set_time(struct device *dev, struct rtc_time *tm)
+{
+	struct sd151_private *data = dev_get_drvdata(dev);
+	int ret;
+
+	mutex_lock(&data->rtc_lock);
+
+	/* The counter phase is unknown after a write */
+	data->rtc_cache.valid = false;
+	data->rtc_cache.ref_valid = false;
+
+	ret = sd151_rtc_write48(data, SD151_RTC0, rtc_tm_to_time64(tm));
+	if (ret)
+		dev_err(dev, "Unable to write RTC when setting time\n");
+
+	mutex_unlock(&data->rtc_lock);
+
+	/* Re-time a running alarm against the new counter */
+	if (!ret && data->alarm_enabled)
+		schedule_work(&data->alarm_work);
+
+	return ret;
+}
+
+static int sd151_rtc_read_time(struct device *dev, struct rtc_time *tm)
+{
+	struct sd151_private *data = dev_get_drvdata(dev);
+	time64_t new_time;
+	int ret;
+
+	mutex_lock(&data->rtc_lock);
+	ret = sd151_rtc_now(data, &new_time);
+	mutex_unlock(&data->rtc_lock);
 	if (ret) {
-		dev_err(dev, "Unable to read RTC word 2 when getting time\n");
+		dev_err(dev, "Unable to read RTC when getting time\n");
 		return ret;
 	}
-	snap_time = tick&0xffff;
-	new_time = new_time | (snap_time<<32);
 
 	rtc_time64_to_tm(new_time,tm);
 	return 0;
@@ -262,87 +865,44 @@ static int sd151_rtc_read_time(struct device *dev, struct rtc_time *tm)
 static int sd151_rtc_set_alarm(struct device *dev, struct rtc_wkalrm *alrm)
 {
 	struct sd151_private *data = dev_get_drvdata(dev);
-  time64_t alarm_time = rtc_tm_to_time64(&alrm->time);
- 	int ret;
- 	unsigned int tick;
-
-	data->alarm_enabled = alrm->enabled;
-	data->alarm_pending = alrm->pending;
-
- 	if (alarm_time > 0x0000ffffffffffff)
-  		return -EINVAL;
+	time64_t now;
+	int ret;
 
-	/*
-	 * The value to write is divided in 3 words of 16 bits
-	 * and written into the sd151 firmware
-	 */
+	mutex_lock(&data->rtc_lock);
 
- 	tick = alarm_time & 0xffff;
- 	ret = regmap_write(data->regmap, SD151_WAKEUP0,	tick);
- 	if (ret) {
- 		dev_err(dev, "Unable to write WAKEUP word 0 when setting alarm\n");
- 		return ret;
- 	}
+	hrtimer_cancel(&data->alarm_timer);
 
- 	tick = (alarm_time>>16) & 0xffff;
- 	ret = regmap_write(data->regmap, SD151_WAKEUP1,	tick);
- 	if (ret) {
- 		dev_err(dev, "Unable to write WAKEUP word 1 when setting alarm\n");
- 		return ret;
- 	}
+	data->alarm_time = rtc_tm_to_time64(&alrm->time);
+	data->alarm_enabled = alrm->enabled;
+	data->alarm_pending = false;
 
- 	tick = (alarm_time>>32) & 0xffff;
- 	ret = regmap_write(data->regmap, SD151_WAKEUP2,	tick);
- 	if (ret) {
- 		dev_err(dev, "Unable to write WAKEUP word 2 when setting alarm\n");
- 		return ret;
- 	}
+	ret = sd151_rtc_wake_sync(data);
+	if (ret) {
+		dev_err(dev, "Unable to write WAKEUP when setting alarm\n");
+		goto out;
+	}
 
-  return 0;
+	if (data->alarm_enabled && !sd151_rtc_now(data, &now))
+		sd151_rtc_alarm_arm(data, now);
 
+out:
+	mutex_unlock(&data->rtc_lock);
+	return ret;
 }
 
 static int sd151_rtc_read_alarm(struct device *dev, struct rtc_wkalrm *alrm)
 {
 	struct sd151_private *data = dev_get_drvdata(dev);
- 	time64_t alarm_time,snap_time;
-  int ret;
-  unsigned int tick;
-
- 	/*
- 	* The value to read is divided in 3 words of 16 bits
- 	* and read from the sd151 firmware
- 	*/
-
- 	ret = regmap_read(data->regmap, SD151_WAKEUP0,	&tick);
- 	if (ret) {
- 		dev_err(dev, "Unable to read RTC word 0 when getting alarm\n");
- 		return ret;
- 	}
- 	snap_time = tick&0xffff;
- 	alarm_time = snap_time;
-
- 	ret = regmap_read(data->regmap, SD151_WAKEUP1,	&tick);
- 	if (ret) {
- 		dev_err(dev, "Unable to read RTC word 1 when getting alarm\n");
- 		return ret;
- 	}
- 	snap_time = tick&0xffff;
- 	alarm_time = alarm_time | (snap_time<<16);
-
- 	ret = regmap_read(data->regmap, SD151_WAKEUP2,	&tick);
- 	if (ret) {
- 		dev_err(dev, "Unable to read RTC word 2 when getting alarm\n");
- 		return ret;
- 	}
- 	snap_time = tick&0xffff;
- 	alarm_time = alarm_time | (snap_time<<32);
-
- 	rtc_time64_to_tm(alarm_time,&alrm->time);
+
+	/* The RTC core alarm is kept by the driver, the slot may hold another */
+	mutex_lock(&data->rtc_lock);
+
+	rtc_time64_to_tm(data->alarm_time,&alrm->time);
 	alrm->enabled = data->alarm_enabled;
 	alrm->pending = data->alarm_pending;
 
- 	return 0;
+	mutex_unlock(&data->rtc_lock);
+	return 0;
 }
 
  /*
@@ -352,14 +912,41 @@ static int sd151_rtc_read_alarm(struct device *dev, struct rtc_wkalrm *alrm)
 static int sd151_alarm_irq_enable(struct device *dev, unsigned int enabled)
 {
 	struct sd151_private *data = dev_get_drvdata(dev);
+	time64_t now;
+	int ret;
 
-	if (!enabled) {
-		/** When IRQ disabled clear wakeup timer */
-		regmap_write(data->regmap, SD151_WAKEUP0,	0);
-		regmap_write(data->regmap, SD151_WAKEUP1,	0);
-		regmap_write(data->regmap, SD151_WAKEUP2,	0);
+	mutex_lock(&data->rtc_lock);
+
+	if (enabled) {
+		ret = sd151_rtc_wake_sync(data);
+		if (ret) {
+			dev_err(dev, "Unable to write WAKEUP when enabling alarm\n");
+			goto out;
+		}
+		data->alarm_enabled = true;
+		if (!data->alarm_pending && !sd151_rtc_now(data, &now))
+			sd151_rtc_alarm_arm(data, now);
+	} else {
+		data->alarm_enabled = false;
+		hrtimer_cancel(&data->alarm_timer);
+		/** When IRQ disabled drop the RTC wakeup request */
+		ret = sd151_rtc_wake_sync(data);
+		if (ret)
+			dev_err(dev, "Unable to write WAKEUP when disabling alarm\n");
 	}
- 	return 0;
+
+out:
+	mutex_unlock(&data->rtc_lock);
+	return ret;
+}
+
+static void sd151_wake_release(struct sd151_private *data)
+{
+	struct sd151_wake *wake, *tmp;
+
+	/* The programmed wakeup stays in the firmware for the power-on */
+	list_for_each_entry_safe(wake, tmp, &data->wake_list, list)
+		sd151_wake_free(data, wake);
 }
 
 /****************************************************************************
@@ -377,12 +964,63 @@ static const struct rtc_class_ops sd151_rtc_ops = {
 /****************************************************************************
  * RTC INITIALIZATION
  ****************************************************************************/
+
+/*
+ * Added before the RTC device, so devm runs it after the RTC is unregistered:
+ * no set_alarm or alarm_irq_enable can arm the timer again. The reference
+ * taken at registration keeps the rtc_device for a last rtc_update_irq().
+ */
+static void sd151_rtc_release(void *context)
+{
+	struct sd151_private *data = context;
+
+	if (IS_ERR_OR_NULL(data->rtc))
+		return;
+
+	mutex_lock(&data->rtc_lock);
+	data->alarm_enabled = false;
+	mutex_unlock(&data->rtc_lock);
+
+	hrtimer_cancel(&data->alarm_timer);
+	cancel_work_sync(&data->alarm_work);
+
+	mutex_lock(&data->rtc_lock);
+	sd151_wake_release(data);
+	mutex_unlock(&data->rtc_lock);
+
+	put_device(&data->rtc->dev);
+}
+
 static int sd151_rtc_init(struct device *dev)
 {
 	struct sd151_private *data = dev_get_drvdata(dev);
+	int ret;
 
 	device_init_wakeup(dev, 1);
 
+	mutex_init(&data->rtc_lock);
+	hrtimer_init(&data->alarm_timer, CLOCK_BOOTTIME, HRTIMER_MODE_ABS);
+	data->alarm_timer.function = sd151_rtc_alarm_expired;
+	INIT_WORK(&data->alarm_work, sd151_rtc_alarm_work);
+	timerqueue_init_head(&data->wake_queue);
+	INIT_LIST_HEAD(&data->wake_list);
+
+	sd151_rtc_probe_block(data);
+
+	/* Start from the wakeup already programmed into the firmware */
+	if (!sd151_rtc_read48(data, SD151_WAKEUP0, &data->wakeup_hw)) {
+		data->wakeup_hw_valid = true;
+		data->alarm_time = data->wakeup_hw;
+	}
+
+	if (device_property_read_u32(dev, "rtc_resync_ms",
+					&data->rtc_cache.resync_ms))
+		data->rtc_cache.resync_ms = SD151_DEF_RTC_RESYNC_MS;
+
+	ret = devm_add_action_or_reset(dev, sd151_rtc_release, data);
+	if (ret)
+		return ret;
+
 	data->rtc = devm_rtc_device_register(dev, data->client->name,
 					 &sd151_rtc_ops, THIS_MODULE);
 
@@ -391,9 +1029,290 @@ static int sd151_rtc_init(struct device *dev)
 		return PTR_ERR(data->rtc);
 	}
 
+	get_device(&data->rtc->dev);
+
 	return 0;
 }
 
+/****************************************************************************
+ * FIRMWARE RESET DETECTION
+ ****************************************************************************/
+
+/*
+ * The firmware has no reset flag: after a brown-out or a crash it restarts
+ * with its default configuration and the RTC counter from zero. A reset is
+ * detected by comparing the live registers with the configuration the driver
+ * wrote (data->shadow), periodically and right after a failed transfer. The
+ * configuration may equal the defaults, so an RTC counter well below the one
+ * extrapolated from the anchor is a reset too.
+ */
+#define SD151_RESET_RETRY_MS            100
+
+/* Called with the bus held, the words are read low first on the regmap */
+static int sd151_reset_read48(struct sd151_private *data, unsigned int reg,
+	time64_t *value)
+{
+	u16 w[SD151_RTC_WORDS];
+	unsigned int val;
+	int ret = 0;
+	int i;
+
+	if (!data->rtc_word_io) {
+		ret = regmap_bulk_read(data->regmap, reg, w, SD151_RTC_WORDS);
+	} else {
+		for (i = 0; i < SD151_RTC_WORDS && !ret; i++) {
+			ret = regmap_read(data->regmap, reg + i, &val);
+			w[i] = val & 0xffff;
+		}
+	}
+	if (ret < 0)
+		return ret;
+
+	*value = (time64_t)w[0] | ((time64_t)w[1] << 16) | ((time64_t)w[2] << 32);
+
+	return 0;
+}
+
+/**
+ * @brief Compare the firmware state with the shadow configuration
+ * @param [in] data struct sd151_private pointer
+ * @param [in] expected RTC counter extrapolated from the anchor, <0 if none
+ * @return 1 if the firmware lost its configuration, 0 if not, <0 on error.
+ * @details Called with the bus held.
+ */
+static int sd151_reset_detect(struct sd151_private *data, time64_t expected)
+{
+	struct sd151_shadow *sh = &data->shadow;
+	unsigned int id, status, val;
+	time64_t v;
+	int ret;
+	int i;
+
+	ret = regmap_read(data->regmap, SD151_CHIP_ID_REG, &id);
+	if (ret < 0)
+		return ret;
+	if (id != SD151_CHIP_ID)
+		return -ENODEV;
+
+	ret = regmap_read(data->regmap, SD151_STATUS, &status);
+	if (ret < 0)
+		return ret;
+
+	if ((sh->valid & SD151_SHADOW_WDOG_EN) &&
+			!!(status & SD151_STATUS_WDOG_EN) != sh->wdog_enabled)
+		return 1;
+
+	if ((sh->valid & SD151_SHADOW_BEEP) &&
+			!!(status & SD151_STATUS_BEEP_DISABLED) != sh->beep_disabled)
+		return 1;
+
+	if (sh->valid & SD151_SHADOW_WDOG_TIMEOUT) {
+		ret = regmap_read(data->regmap, SD151_WDOG_TIMEOUT, &val);
+		if (ret < 0)
+			return ret;
+		if (val != sh->wdog_timeout)
+			return 1;
+	}
+
+	if (sh->valid & SD151_SHADOW_BUTTONS) {
+		ret = regmap_read(data->regmap, SD151_BUTTONS, &val);
+		if (ret < 0)
+			return ret;
+		/* Only the power selection is configuration, presses come and go */
+		if ((val ^ sh->buttons) & (SD151_BUTTON_POWER1|SD151_BUTTON_POWER2))
+			return 1;
+	}
+
+	if (sh->valid & SD151_SHADOW_WAKEUP) {
+		for (i = 0; i < ARRAY_SIZE(sh->wakeup); i++) {
+			ret = regmap_read(data->regmap, SD151_WAKEUP0 + i, &val);
+			if (ret < 0)
+				return ret;
+			if (val != sh->wakeup[i])
+				return 1;
+		}
+	}
+
+	/* A torn read can only be high, the low word is read first */
+	if (expected >= 0) {
+		ret = sd151_reset_read48(data, SD151_RTC0, &v);
+		if (ret < 0)
+			return ret;
+		if (v + SD151_RESET_RTC_TOLERANCE_S < expected)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Write back the shadow configuration
+ * @param [in] data struct sd151_private pointer
+ * @return 0 on success.
+ * @details Called with the bus held. All registers go out in one batch, the
+ * watchdog is enabled last so it starts with the right timeout.
+ */
+static int sd151_reset_replay(struct sd151_private *data)
+{
+	struct sd151_shadow *sh = &data->shadow;
+	struct reg_sequence seq[7];
+	int n = 0;
+	int i;
+
+	if (sh->valid & SD151_SHADOW_WDOG_TIMEOUT)
+		seq[n++] = (struct reg_sequence){ SD151_WDOG_TIMEOUT, sh->wdog_timeout };
+	if (sh->valid & SD151_SHADOW_BUTTONS)
+		seq[n++] = (struct reg_sequence){ SD151_BUTTONS, sh->buttons };
+	if (sh->valid & SD151_SHADOW_WAKEUP) {
+		for (i = 0; i < ARRAY_SIZE(sh->wakeup); i++)
+			seq[n++] = (struct reg_sequence){ SD151_WAKEUP0 + i, sh->wakeup[i] };
+	}
+	if (sh->valid & SD151_SHADOW_BEEP)
+		seq[n++] = (struct reg_sequence){ SD151_COMMAND,
+			sh->beep_disabled ? SD151_BUZZER_DISABLE : SD151_BUZZER_ENABLE };
+	if ((sh->valid & SD151_SHADOW_WDOG_EN) && sh->wdog_enabled)
+		seq[n++] = (struct reg_sequence){ SD151_COMMAND, SD151_WDOG_ENABLE };
+
+	if (!n)
+		return 0;
+
+	return regmap_multi_reg_write(data->regmap, seq, n);
+}
+
+/*
+ * The counter restarted from zero: put back the time extrapolated from the
+ * last anchor. Without an anchor the time is lost until userspace sets it.
+ */
+static void sd151_reset_restore_rtc(struct sd151_private *data)
+{
+	struct sd151_rtc_cache *c = &data->rtc_cache;
+	time64_t expected, now;
+	s64 elapsed;
+
+	mutex_lock(&data->rtc_lock);
+
+	if (!c->valid) {
+		dev_warn(data->dev, "RTC time lost on firmware reset\n");
+		goto out;
+	}
+
+	elapsed = ktime_to_ns(ktime_sub(ktime_get_boottime(), c->edge));
+	expected = c->secs + div_s64(elapsed, NSEC_PER_SEC);
+
+	if (sd151_rtc_read48(data, SD151_RTC0, &now))
+		goto out;
+
+	if (abs(now - expected) > SD151_RESET_RTC_TOLERANCE_S) {
+		if (!sd151_rtc_write48(data, SD151_RTC0, expected))
+			data->reset.rtc_restored++;
+	}
+
+	c->valid = false;
+	c->ref_valid = false;
+
+out:
+	mutex_unlock(&data->rtc_lock);
+}
+
+static void sd151_reset_work(struct work_struct *work)
+{
+	struct sd151_private *data = container_of(to_delayed_work(work),
+		struct sd151_private, reset.work);
+	struct sd151_reset *rs = &data->reset;
+	unsigned int delay = rs->check_ms;
+	struct sd151_rtc_cache *c = &data->rtc_cache;
+	time64_t expected = -1;
+	bool reset = false;
+	u64 t0;
+	int ret;
+
+	WRITE_ONCE(rs->checking, true);
+
+	/* The anchor is taken first: rtc_lock is never taken with the bus held */
+	if (!IS_ERR_OR_NULL(data->rtc)) {
+		mutex_lock(&data->rtc_lock);
+		if (c->valid)
+			expected = c->secs + div_s64(ktime_to_ns(ktime_sub(
+				ktime_get_boottime(), c->edge)), NSEC_PER_SEC);
+		mutex_unlock(&data->rtc_lock);
+	}
+
+	/* Hold the bus so no write changes the shadow between check and replay */
+	ret = sd151_bus_get(data, SD151_BUS_INTERACTIVE);
+	if (ret) {
+		/* Paused for a firmware upgrade */
+		WRITE_ONCE(rs->checking, false);
+		goto out;
+	}
+	ret = sd151_reset_detect(data, expected);
+	if (ret > 0) {
+		reset = true;
+		t0 = ktime_get_ns();
+		ret = sd151_reset_replay(data);
+		rs->replay_ns = ktime_get_ns() - t0;
+	}
+	sd151_bus_put(data);
+
+	if (reset) {
+		rs->count++;
+		dev_warn(data->dev, "firmware reset detected, configuration %s in %llu us\n",
+			ret ? "replay failed" : "replayed",
+			div_u64(rs->replay_ns, NSEC_PER_USEC));
+		if (!IS_ERR_OR_NULL(data->rtc))
+			sd151_reset_restore_rtc(data);
+	}
+
+	/* Not answering yet, the firmware may still be booting: retry soon */
+	if (ret < 0)
+		delay = SD151_RESET_RETRY_MS;
+
+	WRITE_ONCE(rs->checking, false);
+
+out:
+	if (READ_ONCE(rs->check_ms))
+		schedule_delayed_work(&rs->work, msecs_to_jiffies(delay));
+}
+
+/**
+ * @brief Start the firmware reset detection
+ * @param [in] data struct sd151_private pointer
+ * @details The check period is read from the reset_check_ms property,
+ * 0 disables the detection.
+ */
+static void sd151_reset_init(struct sd151_private *data)
+{
+	struct sd151_shadow *sh = &data->shadow;
+
+	/* The firmware may have started the watchdog on its own at boot */
+	if (!(sh->valid & SD151_SHADOW_WDOG_EN)) {
+		sh->wdog_enabled = !!(data->boot_status & SD151_STATUS_WDOG_EN);
+		sh->valid |= SD151_SHADOW_WDOG_EN;
+	}
+
+	if (device_property_read_u32(data->dev, "reset_check_ms",
+					&data->reset.check_ms))
+		data->reset.check_ms = SD151_DEF_RESET_CHECK_MS;
+
+	if (data->reset.check_ms)
+		schedule_delayed_work(&data->reset.work,
+			msecs_to_jiffies(data->reset.check_ms));
+}
+
+/* Check now, e.g. after the firmware was reprogrammed */
+void sd151_reset_check(struct sd151_private *data)
+{
+	if (READ_ONCE(data->reset.check_ms))
+		mod_delayed_work(system_wq, &data->reset.work, 0);
+}
+
+EXPORT_SYMBOL_GPL(sd151_reset_check);
+
+static void sd151_reset_remove(struct sd151_private *data)
+{
+	WRITE_ONCE(data->reset.check_ms, 0);
+	cancel_delayed_work_sync(&data->reset.work);
+}
+
 /****************************************************************************
  * REBOOT / SHUTDOWN NOTIFY
  ****************************************************************************/
@@ -406,13 +1325,16 @@ static int sd151_notify_reboot(struct notifier_block *this,
 
 	switch (code) {
 		case SYS_POWER_OFF:
-			ret = regmap_write(data->regmap, SD151_COMMAND,	SD151_EXEC_POWEROFF);
+			ret = sd151_bus_write(data, SD151_BUS_CRITICAL, SD151_COMMAND,
+				SD151_EXEC_POWEROFF);
 			break;
 		case SYS_RESTART:
-			ret = regmap_write(data->regmap, SD151_COMMAND,	SD151_EXEC_REBOOT);
+			ret = sd151_bus_write(data, SD151_BUS_CRITICAL, SD151_COMMAND,
+				SD151_EXEC_REBOOT);
 			break;
 		case SYS_HALT:
-			ret = regmap_write(data->regmap, SD151_COMMAND,	SD151_EXEC_HALT);
+			ret = sd151_bus_write(data, SD151_BUS_CRITICAL, SD151_COMMAND,
+				SD151_EXEC_HALT);
 			break;
 	}
 	if (ret)
@@ -448,6 +1370,9 @@ int try_input_device_registration(struct device *dev,
 	__set_bit(BTN_0, data->inp.button_dev->keybit);
 	__set_bit(BTN_1, data->inp.button_dev->keybit);
 
+	data->inp.power = pbutton;
+	sd151_button_init(dev, data);
+
 	ret = input_register_device(data->inp.button_dev);
 	if (ret) {
 		dev_err(dev,"button.c: Failed to register device\n");
@@ -456,8 +1381,6 @@ int try_input_device_registration(struct device *dev,
 		return -ENOMEM;
 	}
 
-	data->inp.power = pbutton;
-
 	return 0;
 }
 
@@ -485,8 +1408,14 @@ int sd151_probe(struct i2c_client *client, struct regmap *regmap)
 	data->client = client;
 	data->regmap = regmap;
 	data->dev = &client->dev;
-
-	if (gpio_is_valid(IRQ_GPIO)) {
+	sd151_bus_init(data);
+	INIT_DELAYED_WORK(&data->reset.work, sd151_reset_work);
+	sd151_updi_init(data);
+
+	if (sd151_stub_enabled) {
+		/* The register model raises no interrupt */
+		data->irq = 0;
+	} else if (gpio_is_valid(IRQ_GPIO)) {
 		if(gpio_request(IRQ_GPIO,"SD151_IRQ") < 0){
     	dev_err(dev,"ERROR: GPIO %d request\n", IRQ_GPIO);
     	return -EBUSY;
@@ -511,7 +1440,7 @@ int sd151_probe(struct i2c_client *client, struct regmap *regmap)
 	mutex_init(&data->update_lock);
 
 	/* Verify that we have a sd151 */
-	ret = regmap_read(regmap, SD151_CHIP_ID_REG, &val);
+	ret = sd151_bus_read(data, SD151_BUS_INTERACTIVE, SD151_CHIP_ID_REG, &val);
 	if (ret < 0) {
 		dev_err(dev, "failed to read I2C chip Id\n");
 		goto error;
@@ -524,7 +1453,7 @@ int sd151_probe(struct i2c_client *client, struct regmap *regmap)
 	}
 
 	/* Get version */
-	ret = regmap_read(regmap, SD151_CHIP_VER_REG, &val);
+	ret = sd151_bus_read(data, SD151_BUS_INTERACTIVE, SD151_CHIP_VER_REG, &val);
 	if (ret < 0) {
 		dev_err(dev, "failed to read I2C firmware version\n");
 		goto error;
@@ -537,12 +1466,25 @@ int sd151_probe(struct i2c_client *client, struct regmap *regmap)
 	}
 
 	/* Get status */
-	ret = regmap_read(regmap, SD151_STATUS, &val);
+	ret = sd151_bus_read(data, SD151_BUS_INTERACTIVE, SD151_STATUS, &val);
 	if (ret < 0) {
 		dev_err(dev, "failed to access device when reading status\n");
 		goto error;
 	}
 
+	data->boot_status = val;
+
+	/* Bus clock, as configured on the adapter (i2c_baudrate overlay param) */
+	if (client->adapter->dev.parent)
+		device_property_read_u32(client->adapter->dev.parent,
+			"clock-frequency", &data->bus_hz);
+
+	if (!device_property_read_u32(dev, "selftest", &val) && val) {
+		if (sd151_selftest(data, min_t(unsigned int, val,
+				SD151_SELFTEST_MAX_COUNT)))
+			dev_warn(dev, "I2C link unreliable, lower i2c_baudrate\n");
+	}
+
 	/* HWMON register */
 	hwmon_dev = devm_hwmon_device_register_with_info(dev, client->name,
 							 data, &sd151_chip_info, NULL);
@@ -566,6 +1508,25 @@ int sd151_probe(struct i2c_client *client, struct regmap *regmap)
 		else
 			data->overlay_wdog_wait = val;
 
+		if (device_property_read_u32(dev, "wdog_pretimeout", &val))
+			data->overlay_wdog_pretimeout = 0;
+		else
+			data->overlay_wdog_pretimeout = val;
+
+		if (device_property_read_bool(dev, "wdog_pretimeout_beep"))
+			data->overlay_wdog_pretimeout_beep = true;
+
+		if (device_property_read_u32(dev, "wdog_min_heartbeat_ms", &val))
+			data->overlay_wdog_min_heartbeat = -1;
+		else
+			data->overlay_wdog_min_heartbeat = val;
+
+		if (device_property_read_bool(dev, "wdog_boot_enabled"))
+			data->overlay_wdog_boot_enabled = true;
+
+		if (device_property_read_bool(dev, "wdog_mux"))
+			data->overlay_wdog_mux = true;
+
 		ret = sd151_wdog_init(data);
 		if (ret)
 			goto error;
@@ -605,6 +1566,8 @@ int sd151_probe(struct i2c_client *client, struct regmap *regmap)
 
 	try_input_device_registration(dev,data,power_button);
 
+	sd151_reset_init(data);
+
 	/*
 	 * Register the tts_notifier to reboot notifier list so that the _TTS
 	 * object can also be evaluated when the system enters S5.
@@ -629,6 +1592,11 @@ static int sd151_i2c_probe(struct i2c_client *client,
 	config.reg_bits = 8;
 	config.cache_type = REGCACHE_NONE;
 
+#ifdef CONFIG_SD151_TEST
+	if (sd151_stub_enabled)
+		return sd151_probe(client,sd151_stub_regmap_init(client, &config));
+#endif
+
 	return sd151_probe(client,devm_regmap_init_i2c(client, &config));
 }
 
@@ -637,8 +1605,13 @@ static int sd151_remove(struct i2c_client *client)
 	struct device *dev = &client->dev;
 	struct sd151_private *data = dev_get_drvdata(dev);
 
-	watchdog_unregister_device(&data->wdd);
-	free_irq(data->irq, sd151_irq);
+	sd151_updi_remove(data);
+	sd151_reset_remove(data);
+	sd151_wdog_remove(data);
+	/* The RTC alarm is stopped by sd151_rtc_release() once it is unregistered */
+	if (data->irq)
+		free_irq(data->irq, sd151_irq);
+	sd151_button_remove(data);
 	input_free_device(data->inp.button_dev);
 	sd151_proc_remove(data);
 	unregister_reboot_notifier(&sd151_notifier);
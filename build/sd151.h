@@ -35,6 +35,12 @@
 #include <linux/time64.h>
 #include <linux/watchdog.h>
 #include <linux/i2c.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/miscdevice.h>
+#include <linux/sched.h>
+#include <linux/timerqueue.h>
+#include <linux/wait.h>
 #include <asm/gpio.h>
 
 struct device;
@@ -46,16 +52,166 @@ struct device;
 #define IRQ_GPIO                        23
 #define UPDI_GPIO                       24
 
+#define SD151_WDMUX_NAME_LEN            TASK_COMM_LEN
+#define SD151_WAKE_NAME_LEN             16
+#define SD151_WAKE_MAX                  16
+#define SD151_WAKE_RTC                  "rtc"
+
+/* A named wake request, node.expires holds RTC seconds */
+struct sd151_wake {
+  struct timerqueue_node node;
+  struct list_head     list;
+  char                 name[SD151_WAKE_NAME_LEN];
+};
+
+#define SD151_BUTTON_KEYS               3  /* short, long, double */
+#define SD151_DEF_BUTTON_DEBOUNCE_MS    20
+#define SD151_DEF_BUTTON_LONG_MS        1000
+#define SD151_DEF_BUTTON_DOUBLE_MS      300
+#define SD151_DEF_BUTTON_REPEAT_MS      0
+
+/* Per button gesture state machine, see sd151_button.c */
+struct sd151_button {
+  struct sd151_private *data;
+  struct hrtimer       timer;
+  ktime_t              expires;
+  unsigned int         state;
+  bool                 second;
+  unsigned int         keys[SD151_BUTTON_KEYS];
+  unsigned long        glitches;
+};
+
 struct sd151_input {
   struct input_dev     *button_dev;
   u16                  button;
   u16                  power;
+  bool                 gestures;
+  spinlock_t           lock;
+  unsigned int         debounce_ms;
+  unsigned int         long_ms;
+  unsigned int         double_ms;
+  unsigned int         repeat_ms;
+  struct sd151_button  btn[NBUTTON];
+};
+
+struct sd151_wdmux {
+  struct miscdevice    misc;
+  struct mutex         lock;
+  struct list_head     clients;
+  struct delayed_work  work;
+  unsigned long        last_ping;
+  unsigned int         nclients;
+  unsigned int         expirations;
+  bool                 expired;
+  bool                 started_hw;
+  bool                 registered;
+};
+
+struct sd151_rtc_cache {
+  ktime_t              edge;
+  s64                  err_ns;
+  time64_t             secs;
+  ktime_t              ref_edge;
+  time64_t             ref_secs;
+  bool                 valid;
+  bool                 ref_valid;
+  unsigned int         resync_ms;
+  unsigned long        hw_reads;
+  unsigned long        cached_reads;
+  unsigned long        mismatches;
+  s64                  drift_ppb;
+};
+
+/* Bus access classes, in priority order */
+enum {
+  SD151_BUS_CRITICAL = 0,       /* watchdog, power commands */
+  SD151_BUS_INTERACTIVE,        /* IRQ, buttons, RTC, user commands */
+  SD151_BUS_BULK,               /* telemetry, reports, self-test */
+  SD151_BUS_CLASSES
+};
+
+struct sd151_bus_class {
+  unsigned long        xfers;
+  unsigned int         waiting;
+  unsigned int         max_depth;
+  u64                  wait_ns;
+  u64                  max_wait_ns;
+};
+
+/* Per device bus arbiter, see sd151_bus.c */
+struct sd151_bus {
+  spinlock_t           lock;
+  wait_queue_head_t    wq;
+  bool                 busy;
+  bool                 paused;
+  struct sd151_bus_class cls[SD151_BUS_CLASSES];
+};
+
+#define SD151_SHADOW_WDOG_TIMEOUT       BIT(0)
+#define SD151_SHADOW_BUTTONS            BIT(1)
+#define SD151_SHADOW_WAKEUP             BIT(2)
+#define SD151_SHADOW_WDOG_EN            BIT(3)
+#define SD151_SHADOW_BEEP               BIT(4)
+
+/* Configuration last written to the firmware, replayed after a MCU reset */
+struct sd151_shadow {
+  unsigned int         valid;
+  u16                  wdog_timeout;
+  u16                  buttons;
+  u16                  wakeup[3];
+  bool                 wdog_enabled;
+  bool                 beep_disabled;
+};
+
+/* Firmware reset detection, see sd151.c */
+struct sd151_reset {
+  struct delayed_work  work;
+  unsigned int         check_ms;
+  bool                 checking;
+  unsigned long        count;
+  unsigned long        rtc_restored;
+  u64                  replay_ns;
+};
+
+#define SD151_UPDI_FW_NAME_LEN          64
+
+/* Firmware upgrade through UPDI, see sd151_updi.c */
+struct sd151_updi {
+  struct work_struct   work;
+  struct mutex         lock;
+  char                 fw_name[SD151_UPDI_FW_NAME_LEN];
+  unsigned int         baud;
+  u32                  bit_ns;
+  bool                 running;
+  const char           *phase;
+  unsigned int         page;
+  unsigned int         pages;
+  int                  result;
+  unsigned int         retries;
+  u64                  irqoff_max_ns;
+};
+
+#define SD151_SELFTEST_DEF_COUNT        1000
+#define SD151_SELFTEST_MAX_COUNT        100000
+
+/* Result of the last bus self-test */
+struct sd151_selftest {
+  unsigned int         count;
+  unsigned int         errors;
+  unsigned int         mismatches;
+  u64                  min_ns;
+  u64                  max_ns;
+  u64                  total_ns;
 };
 
 struct sd151_private {
 	struct device                 *dev;
   struct i2c_client             *client;
   struct regmap                 *regmap;
+  struct sd151_bus              bus;
+  struct sd151_shadow           shadow;
+  struct sd151_reset            reset;
+  struct sd151_updi             updi;
   struct watchdog_device        wdd;
   struct rtc_device             *rtc;
   struct work_struct            irq_work;
@@ -64,15 +220,40 @@ struct sd151_private {
   bool                          overlay_wdog_nowayout;
   int                           overlay_wdog_timeout;
   int                           overlay_wdog_wait;
+  int                           overlay_wdog_pretimeout;
+  bool                          overlay_wdog_pretimeout_beep;
+  int                           overlay_wdog_min_heartbeat;
+  bool                          overlay_wdog_boot_enabled;
+  bool                          overlay_wdog_mux;
   int                           device_wdog_timeout;
   int                           device_wdog_wait;
   int                           wdog_wait;
+  int                           wdog_hw_timeout;
+  struct hrtimer                pretimeout_timer;
+  struct work_struct            pretimeout_work;
+  struct sd151_wdmux            wdmux;
   struct mutex                  update_lock;
   u16                           firmware_version;
+  u16                           boot_status;
   bool                          alarm_enabled;
   bool                          alarm_pending;
+  time64_t                      alarm_time;
+  struct hrtimer                alarm_timer;
+  struct work_struct            alarm_work;
+  struct mutex                  rtc_lock;
+  struct timerqueue_head        wake_queue;
+  struct list_head              wake_list;
+  unsigned int                  wake_count;
+  time64_t                      wakeup_hw;
+  bool                          wakeup_hw_valid;
+  unsigned long                 wakeup_writes;
+  unsigned long                 wakeup_skipped;
+  bool                          rtc_word_io;
+  struct sd151_rtc_cache        rtc_cache;
   bool                          beep_disabled;
   u16                           communication_error;
+  u32                           bus_hz;
+  struct sd151_selftest         selftest;
   //int                           power_button;
   /* Voltage registers */
   bool                          volt_valid[NUM_CH_VIN];
@@ -130,6 +311,7 @@ struct sd151_private {
 #define SD151_WDOG_TIMEOUT_POS          0
 #define SD151_WDOG_WAIT_MASK            0xFF00
 #define SD151_WDOG_WAIT_POS             8
+#define SD151_WDOG_MAX_HW_TIMEOUT       255
 
 #define SD151_VOLTAGE_5V_BOARD          0x0A
 #define SD151_VOLTAGE_5V_BOARD_MIN      0x0B
@@ -153,5 +335,20 @@ struct sd151_private {
 #define SD151_WAKEUP2                   0x1F
 
 #define SD151_MIN_WDOG_WAIT             45
+#define SD151_DEF_RTC_RESYNC_MS         60000
+#define SD151_DEF_RESET_CHECK_MS        5000
+#define SD151_DEF_UPDI_BAUD             100000
+/* A RX chunk with its first byte timeout keeps interrupts off for ~12 ms */
+#define SD151_MIN_UPDI_BAUD             50000
+#define SD151_DEF_UPDI_FW               "sd151.bin"
+/*
+ * Keepalives closer than the minimum heartbeat are deferred up to
+ * min_hw_heartbeat_ms: the timeout must be longer than the default 1 s
+ * heartbeat, otherwise a deferred ping could arrive after the reset.
+ */
+#define SD151_MIN_WDOG_TIMEOUT          2
+/* Watchdog core limit (timeouts are converted to ms in an unsigned int) */
+#define SD151_MAX_WDOG_TIMEOUT          (UINT_MAX / 1000)
+#define SD151_DEF_WDOG_MIN_HEARTBEAT    1000
 
 #endif /* _SD151_H */
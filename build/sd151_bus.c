@@ -0,0 +1,277 @@
+/*
+ * sd151_bus.c - Part of OPEN-EYES PI-POW HAT product, Linux kernel modules
+ * for hardware monitoring
+ * This file implements the SD151 bus access scheduler.
+ * Author:
+ * Massimiliano Negretti <massimiliano.negretti@open-eyes.it> 2021-07-4
+ *
+ * Every register access of the driver goes through the arbiter with a
+ * priority class: critical (watchdog pings, power commands), interactive
+ * (IRQ, buttons, RTC, user commands) and bulk (telemetry and reports).
+ * The bus is granted one transfer at a time to the highest class waiting,
+ * so a watchdog ping waits at most one transfer behind a telemetry burst.
+ *
+ * This file is part of sd151-hwmon distribution
+ * https://github.com/openeyes-lab/sd151-hwmon
+ *
+ * Copyright (c) 2021 OPEN-EYES Srl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/module.h>
+
+#include "sd151.h"
+
+/****************************************************************************
+ * ARBITER
+ ****************************************************************************/
+
+/* Called with bus->lock held */
+static bool sd151_bus_can_run(struct sd151_bus *bus, int cls)
+{
+	int i;
+
+	if (bus->busy)
+		return false;
+
+	for (i = 0; i < cls; i++) {
+		if (bus->cls[i].waiting)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief Wait for the bus
+ * @param [in] data struct sd151_private pointer
+ * @param [in] cls SD151_BUS_CRITICAL, SD151_BUS_INTERACTIVE or SD151_BUS_BULK
+ * @return 0 when the bus is held, -EBUSY while the bus is paused.
+ * @details Sleeps until the bus is free and no higher class is waiting.
+ * Hold it for a single transfer so higher classes are not delayed.
+ */
+int sd151_bus_get(struct sd151_private *data, int cls)
+{
+	struct sd151_bus *bus = &data->bus;
+	struct sd151_bus_class *c = &bus->cls[cls];
+	u64 t0 = ktime_get_ns();
+	u64 ns;
+
+	spin_lock_irq(&bus->lock);
+
+	c->waiting++;
+	c->max_depth = max(c->max_depth, c->waiting);
+
+	wait_event_lock_irq(bus->wq, sd151_bus_can_run(bus, cls), bus->lock);
+
+	c->waiting--;
+	if (bus->paused) {
+		spin_unlock_irq(&bus->lock);
+		return -EBUSY;
+	}
+	bus->busy = true;
+
+	ns = ktime_get_ns() - t0;
+	c->xfers++;
+	c->wait_ns += ns;
+	c->max_wait_ns = max(c->max_wait_ns, ns);
+
+	spin_unlock_irq(&bus->lock);
+
+	return 0;
+}
+
+EXPORT_SYMBOL_GPL(sd151_bus_get);
+
+void sd151_bus_put(struct sd151_private *data)
+{
+	struct sd151_bus *bus = &data->bus;
+
+	spin_lock_irq(&bus->lock);
+	bus->busy = false;
+	spin_unlock_irq(&bus->lock);
+
+	/* Waiters of a lower class than the best one go back to sleep */
+	wake_up_all(&bus->wq);
+}
+
+EXPORT_SYMBOL_GPL(sd151_bus_put);
+
+/**
+ * @brief Pause or resume all register access
+ * @param [in] data struct sd151_private pointer
+ * @param [in] pause true to pause
+ * @details Waits for the transfer in progress. While paused every access
+ * fails with -EBUSY without touching the bus, e.g. while the MCU is being
+ * reprogrammed.
+ */
+void sd151_bus_pause(struct sd151_private *data, bool pause)
+{
+	struct sd151_bus *bus = &data->bus;
+
+	spin_lock_irq(&bus->lock);
+	wait_event_lock_irq(bus->wq, !bus->busy, bus->lock);
+	bus->paused = pause;
+	spin_unlock_irq(&bus->lock);
+
+	wake_up_all(&bus->wq);
+}
+
+EXPORT_SYMBOL_GPL(sd151_bus_pause);
+
+/****************************************************************************
+ * REGISTER ACCESS
+ ****************************************************************************/
+
+/*
+ * Successful writes of configuration registers are mirrored in data->shadow,
+ * so the configuration can be replayed when the MCU resets. Called with the
+ * bus held.
+ */
+static void sd151_bus_shadow(struct sd151_private *data, unsigned int reg,
+	unsigned int val)
+{
+	struct sd151_shadow *sh = &data->shadow;
+
+	switch (reg) {
+		case SD151_WDOG_TIMEOUT:
+			sh->wdog_timeout = val;
+			sh->valid |= SD151_SHADOW_WDOG_TIMEOUT;
+			break;
+		case SD151_BUTTONS:
+			sh->buttons = val;
+			sh->valid |= SD151_SHADOW_BUTTONS;
+			break;
+		case SD151_WAKEUP0:
+		case SD151_WAKEUP1:
+		case SD151_WAKEUP2:
+			sh->wakeup[reg - SD151_WAKEUP0] = val;
+			sh->valid |= SD151_SHADOW_WAKEUP;
+			break;
+		case SD151_COMMAND:
+			if (val == SD151_WDOG_ENABLE || val == SD151_WDOG_DISABLE) {
+				sh->wdog_enabled = (val == SD151_WDOG_ENABLE);
+				sh->valid |= SD151_SHADOW_WDOG_EN;
+			} else if (val == SD151_BUZZER_ENABLE || val == SD151_BUZZER_DISABLE) {
+				sh->beep_disabled = (val == SD151_BUZZER_DISABLE);
+				sh->valid |= SD151_SHADOW_BEEP;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+/* A failed transfer may be a MCU reset: check it now */
+static void sd151_bus_error(struct sd151_private *data)
+{
+	if (data->reset.check_ms && !READ_ONCE(data->reset.checking))
+		mod_delayed_work(system_wq, &data->reset.work, 0);
+}
+
+int sd151_bus_read(struct sd151_private *data, int cls, unsigned int reg,
+	unsigned int *val)
+{
+	int ret;
+
+	ret = sd151_bus_get(data, cls);
+	if (ret)
+		return ret;
+	ret = regmap_read(data->regmap, reg, val);
+	sd151_bus_put(data);
+
+	if (ret < 0)
+		sd151_bus_error(data);
+
+	return ret;
+}
+
+EXPORT_SYMBOL_GPL(sd151_bus_read);
+
+int sd151_bus_write(struct sd151_private *data, int cls, unsigned int reg,
+	unsigned int val)
+{
+	int ret;
+
+	ret = sd151_bus_get(data, cls);
+	if (ret)
+		return ret;
+	ret = regmap_write(data->regmap, reg, val);
+	if (!ret)
+		sd151_bus_shadow(data, reg, val);
+	sd151_bus_put(data);
+
+	if (ret < 0)
+		sd151_bus_error(data);
+
+	return ret;
+}
+
+EXPORT_SYMBOL_GPL(sd151_bus_write);
+
+int sd151_bus_bulk_read(struct sd151_private *data, int cls, unsigned int reg,
+	void *val, size_t count)
+{
+	int ret;
+
+	ret = sd151_bus_get(data, cls);
+	if (ret)
+		return ret;
+	ret = regmap_bulk_read(data->regmap, reg, val, count);
+	sd151_bus_put(data);
+
+	if (ret < 0)
+		sd151_bus_error(data);
+
+	return ret;
+}
+
+EXPORT_SYMBOL_GPL(sd151_bus_bulk_read);
+
+int sd151_bus_bulk_write(struct sd151_private *data, int cls, unsigned int reg,
+	const void *val, size_t count)
+{
+	const u16 *w = val;
+	size_t i;
+	int ret;
+
+	ret = sd151_bus_get(data, cls);
+	if (ret)
+		return ret;
+	ret = regmap_bulk_write(data->regmap, reg, val, count);
+	for (i = 0; !ret && i < count; i++)
+		sd151_bus_shadow(data, reg + i, w[i]);
+	sd151_bus_put(data);
+
+	if (ret < 0)
+		sd151_bus_error(data);
+
+	return ret;
+}
+
+EXPORT_SYMBOL_GPL(sd151_bus_bulk_write);
+
+/****************************************************************************
+ * BUS INITIALIZATION
+ ****************************************************************************/
+
+void sd151_bus_init(struct sd151_private *data)
+{
+	spin_lock_init(&data->bus.lock);
+	init_waitqueue_head(&data->bus.wq);
+}
+
+EXPORT_SYMBOL_GPL(sd151_bus_init);
@@ -0,0 +1,282 @@
+/*
+ * sd151_button.c - Part of OPEN-EYES PI-POW HAT product, Linux kernel modules
+ * for hardware monitoring
+ * This driver handles the SD151 button gestures.
+ * Author:
+ * Massimiliano Negretti <massimiliano.negretti@open-eyes.it> 2021-07-4
+ *
+ * With the button_gestures overlay property every button runs a small state
+ * machine timed by an hrtimer: presses shorter than the debounce time are
+ * dropped, and short press, long press (with optional hold-repeat) and
+ * double press are reported as distinct key codes. Without the property the
+ * raw button edges are reported as before.
+ *
+ * This file is part of sd151-hwmon distribution
+ * https://github.com/openeyes-lab/sd151-hwmon
+ *
+ * Copyright (c) 2021 OPEN-EYES Srl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/module.h>
+#include <linux/input.h>
+#include <linux/property.h>
+
+#include "sd151.h"
+
+enum {
+	SD151_BUTTON_IDLE = 0,
+	SD151_BUTTON_DEBOUNCE,          /* pressed, waiting the debounce time */
+	SD151_BUTTON_PRESSED,           /* pressed, waiting the long press time */
+	SD151_BUTTON_LONG,              /* long press reported, repeating */
+	SD151_BUTTON_WAIT_DOUBLE,       /* released, waiting a second press */
+	SD151_BUTTON_WAIT_RELEASE,      /* double press reported */
+};
+
+#define SD151_KEY_SHORT                 0
+#define SD151_KEY_LONG                  1
+#define SD151_KEY_DOUBLE                2
+
+/****************************************************************************
+ * STATE MACHINE
+ ****************************************************************************/
+
+/*
+ * The state is changed both from the IRQ work (button edges) and from the
+ * hrtimer callback (time outs), under inp.lock. A callback that lost the race
+ * against a re-arm sees an expiry still in the future and does nothing.
+ */
+
+static void sd151_button_arm(struct sd151_button *btn, unsigned int ms)
+{
+	btn->expires = ktime_add_ms(ktime_get(), ms);
+	hrtimer_start(&btn->timer, btn->expires, HRTIMER_MODE_ABS);
+}
+
+static void sd151_button_tap(struct input_dev *dev, unsigned int code)
+{
+	input_report_key(dev, code, 1);
+	input_sync(dev);
+	input_report_key(dev, code, 0);
+	input_sync(dev);
+}
+
+static enum hrtimer_restart sd151_button_expired(struct hrtimer *timer)
+{
+	struct sd151_button *btn = container_of(timer, struct sd151_button,
+		timer);
+	struct sd151_input *inp = &btn->data->inp;
+	struct input_dev *dev = inp->button_dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&inp->lock, flags);
+
+	if (ktime_before(ktime_get(), btn->expires))
+		goto out;
+
+	switch (btn->state) {
+		case SD151_BUTTON_DEBOUNCE:
+			if (btn->second) {
+				sd151_button_tap(dev, btn->keys[SD151_KEY_DOUBLE]);
+				btn->state = SD151_BUTTON_WAIT_RELEASE;
+				break;
+			}
+			btn->state = SD151_BUTTON_PRESSED;
+			if (btn->keys[SD151_KEY_LONG])
+				sd151_button_arm(btn, inp->long_ms > inp->debounce_ms ?
+					inp->long_ms - inp->debounce_ms : 0);
+			break;
+		case SD151_BUTTON_PRESSED:
+			input_report_key(dev, btn->keys[SD151_KEY_LONG], 1);
+			input_sync(dev);
+			btn->state = SD151_BUTTON_LONG;
+			if (inp->repeat_ms)
+				sd151_button_arm(btn, inp->repeat_ms);
+			break;
+		case SD151_BUTTON_LONG:
+			input_event(dev, EV_KEY, btn->keys[SD151_KEY_LONG], 2);
+			input_sync(dev);
+			sd151_button_arm(btn, inp->repeat_ms);
+			break;
+		case SD151_BUTTON_WAIT_DOUBLE:
+			sd151_button_tap(dev, btn->keys[SD151_KEY_SHORT]);
+			btn->state = SD151_BUTTON_IDLE;
+			break;
+		default:
+			break;
+	}
+
+out:
+	spin_unlock_irqrestore(&inp->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * @brief Feed a button edge into the state machine
+ * @param [in] data struct sd151_private pointer
+ * @param [in] i button index
+ * @param [in] pressed new button level
+ */
+void sd151_button_event(struct sd151_private *data, int i, bool pressed)
+{
+	struct sd151_input *inp = &data->inp;
+	struct sd151_button *btn = &inp->btn[i];
+	unsigned long flags;
+
+	spin_lock_irqsave(&inp->lock, flags);
+
+	switch (btn->state) {
+		case SD151_BUTTON_IDLE:
+		case SD151_BUTTON_WAIT_DOUBLE:
+			if (!pressed)
+				break;
+			btn->second = (btn->state == SD151_BUTTON_WAIT_DOUBLE);
+			btn->state = SD151_BUTTON_DEBOUNCE;
+			sd151_button_arm(btn, inp->debounce_ms);
+			break;
+		case SD151_BUTTON_DEBOUNCE:
+			if (pressed)
+				break;
+			btn->glitches++;
+			if (btn->second) {
+				/* Keep waiting for a real second press */
+				btn->state = SD151_BUTTON_WAIT_DOUBLE;
+				sd151_button_arm(btn, inp->double_ms);
+			} else {
+				btn->state = SD151_BUTTON_IDLE;
+				hrtimer_try_to_cancel(&btn->timer);
+			}
+			break;
+		case SD151_BUTTON_PRESSED:
+			if (pressed)
+				break;
+			if (btn->keys[SD151_KEY_DOUBLE] && inp->double_ms) {
+				btn->state = SD151_BUTTON_WAIT_DOUBLE;
+				sd151_button_arm(btn, inp->double_ms);
+			} else {
+				sd151_button_tap(inp->button_dev, btn->keys[SD151_KEY_SHORT]);
+				btn->state = SD151_BUTTON_IDLE;
+				hrtimer_try_to_cancel(&btn->timer);
+			}
+			break;
+		case SD151_BUTTON_LONG:
+			if (pressed)
+				break;
+			input_report_key(inp->button_dev, btn->keys[SD151_KEY_LONG], 0);
+			input_sync(inp->button_dev);
+			btn->state = SD151_BUTTON_IDLE;
+			hrtimer_try_to_cancel(&btn->timer);
+			break;
+		case SD151_BUTTON_WAIT_RELEASE:
+			if (!pressed)
+				btn->state = SD151_BUTTON_IDLE;
+			break;
+	}
+
+	spin_unlock_irqrestore(&inp->lock, flags);
+}
+
+EXPORT_SYMBOL_GPL(sd151_button_event);
+
+/****************************************************************************
+ * BUTTON INITIALIZATION
+ ****************************************************************************/
+
+/**
+ * @brief Read the gesture configuration from device tree
+ * @param [in] dev device pointer
+ * @param [in] data struct sd151_private pointer
+ * @return 0 on success.
+ * @details Called before the input device is registered, inp.power must be
+ * already set. button<N>_keys holds the short, long and double press codes;
+ * a 0 code disables that gesture.
+ */
+int sd151_button_init(struct device *dev, struct sd151_private *data)
+{
+	struct sd151_input *inp = &data->inp;
+	struct sd151_button *btn;
+	char prop[16];
+	int i, j, n;
+
+	spin_lock_init(&inp->lock);
+
+	inp->gestures = device_property_read_bool(dev, "button_gestures");
+	if (!inp->gestures)
+		return 0;
+
+	if (device_property_read_u32(dev, "button_debounce_ms", &inp->debounce_ms))
+		inp->debounce_ms = SD151_DEF_BUTTON_DEBOUNCE_MS;
+	if (device_property_read_u32(dev, "button_long_ms", &inp->long_ms))
+		inp->long_ms = SD151_DEF_BUTTON_LONG_MS;
+	if (device_property_read_u32(dev, "button_double_ms", &inp->double_ms))
+		inp->double_ms = SD151_DEF_BUTTON_DOUBLE_MS;
+	if (device_property_read_u32(dev, "button_repeat_ms", &inp->repeat_ms))
+		inp->repeat_ms = SD151_DEF_BUTTON_REPEAT_MS;
+
+	for (i=0; i<NBUTTON; i++) {
+		btn = &inp->btn[i];
+		btn->data = data;
+		btn->state = SD151_BUTTON_IDLE;
+		hrtimer_init(&btn->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		btn->timer.function = sd151_button_expired;
+
+		btn->keys[SD151_KEY_SHORT] = (inp->power & BIT(i)) ? KEY_POWER : BTN_0+i;
+		btn->keys[SD151_KEY_LONG] = 0;
+		btn->keys[SD151_KEY_DOUBLE] = 0;
+
+		snprintf(prop, sizeof(prop), "button%d_keys", i);
+		n = device_property_count_u32(dev, prop);
+		if (n > 0)
+			device_property_read_u32_array(dev, prop, btn->keys,
+				min(n, SD151_BUTTON_KEYS));
+
+		for (j=0; j<SD151_BUTTON_KEYS; j++) {
+			if (btn->keys[j] > KEY_MAX) {
+				dev_err(dev, "Bad key code %u for button %d\n", btn->keys[j], i);
+				btn->keys[j] = 0;
+			}
+			if (btn->keys[j])
+				__set_bit(btn->keys[j], inp->button_dev->keybit);
+		}
+
+		/* The short press is always reported, a 0 code is not "disabled" */
+		if (!btn->keys[SD151_KEY_SHORT]) {
+			btn->keys[SD151_KEY_SHORT] = BTN_0+i;
+			__set_bit(BTN_0+i, inp->button_dev->keybit);
+		}
+	}
+
+	dev_info(dev, "button gestures: debounce %ums long %ums double %ums repeat %ums\n",
+		inp->debounce_ms, inp->long_ms, inp->double_ms, inp->repeat_ms);
+
+	return 0;
+}
+
+EXPORT_SYMBOL_GPL(sd151_button_init);
+
+void sd151_button_remove(struct sd151_private *data)
+{
+	int i;
+
+	if (!data->inp.gestures)
+		return;
+
+	for (i=0; i<NBUTTON; i++)
+		hrtimer_cancel(&data->inp.btn[i].timer);
+}
+
+EXPORT_SYMBOL_GPL(sd151_button_remove);
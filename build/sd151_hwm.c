@@ -30,6 +30,9 @@
 
 #include "sd151.h"
 
+extern int sd151_bus_read(struct sd151_private *, int, unsigned int,
+	unsigned int *);
+
 /**
  * @brief HWMON function sd151 get voltage
  * @param [in] dev struct device pointer
@@ -52,7 +55,7 @@ static int sd151_get_voltage(struct device *dev, u8 ch)
 																						|| !data->volt_valid[ch]) {
 			reg = SD151_VOLTAGE_5V_BOARD + ch*3;
 			/* Get value */
-			ret = regmap_read(data->regmap, reg, &voltage);
+			ret = sd151_bus_read(data, SD151_BUS_BULK, reg, &voltage);
 			if (ret < 0) {
 				dev_err(dev, "failed to read I2C when get voltage\n");
 				goto close;
@@ -94,7 +97,7 @@ static int sd151_get_voltage_max(struct device *dev, u8 ch)
 																		|| !data->volt_max_valid[ch]) {
 			reg = SD151_VOLTAGE_5V_BOARD_MAX + ch*3;
 			/* Get value */
-			ret = regmap_read(data->regmap, reg, &voltage);
+			ret = sd151_bus_read(data, SD151_BUS_BULK, reg, &voltage);
 			if (ret < 0) {
 				dev_err(dev, "failed to read I2C when get MAX voltage\n");
 				goto close;
@@ -136,7 +139,7 @@ static int sd151_get_voltage_min(struct device *dev, u8 ch)
 																			|| !data->volt_min_valid[ch]) {
 			reg = SD151_VOLTAGE_5V_BOARD_MIN + ch*3;
 			/* Get value */
-			ret = regmap_read(data->regmap, reg, &voltage);
+			ret = sd151_bus_read(data, SD151_BUS_BULK, reg, &voltage);
 			if (ret < 0) {
 				dev_err(dev, "failed to read I2C when get MIN voltage\n");
 				goto close;
@@ -0,0 +1,217 @@
+/*
+ * sd151_kunit.c - Part of OPEN-EYES PI-POW HAT product, Linux kernel modules
+ * for hardware monitoring
+ * KUnit suite run on the SD151 register model.
+ * Author:
+ * Massimiliano Negretti <massimiliano.negretti@open-eyes.it> 2021-07-4
+ *
+ * Included by sd151_stub.c when the kernel has KUnit, so the suite sees the
+ * model internals. It checks the register model and the bus arbiter and the
+ * number of I2C transactions they issue; the driver-level measurements are
+ * done by test/sd151-stub.sh. Results are in the kernel log and in
+ * /sys/kernel/debug/kunit/sd151/results.
+ *
+ * This file is part of sd151-hwmon distribution
+ * https://github.com/openeyes-lab/sd151-hwmon
+ *
+ * Copyright (c) 2021 OPEN-EYES Srl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <kunit/test.h>
+
+extern void sd151_bus_init(struct sd151_private *);
+extern int sd151_bus_read(struct sd151_private *, int, unsigned int,
+	unsigned int *);
+extern int sd151_bus_write(struct sd151_private *, int, unsigned int,
+	unsigned int);
+extern int sd151_bus_bulk_read(struct sd151_private *, int, unsigned int,
+	void *, size_t);
+extern int sd151_bus_bulk_write(struct sd151_private *, int, unsigned int,
+	const void *, size_t);
+
+struct sd151_kunit {
+	struct device                 *dev;
+	struct sd151_stub             *stub;
+	struct sd151_private          data;
+	/* Per test model parameters, the module parameters are not used */
+	unsigned int                  latency_us;
+	unsigned int                  error_every;
+};
+
+/****************************************************************************
+ * FIXTURE
+ ****************************************************************************/
+
+static int sd151_kunit_init(struct kunit *test)
+{
+	struct regmap_config config = {
+		.reg_bits = 8,
+		.val_bits = 16,
+		.max_register = SD151_NUM_REGS - 1,
+		.cache_type = REGCACHE_NONE,
+	};
+	struct sd151_kunit *ctx;
+	struct regmap *regmap;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx);
+
+	ctx->dev = root_device_register("sd151-kunit");
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->dev);
+
+	/* No debugfs: "sd151" belongs to a device bound with stub=1 */
+	ctx->stub = sd151_stub_create(ctx->dev, NULL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ctx->stub);
+	ctx->stub->latency_us = &ctx->latency_us;
+	ctx->stub->error_every = &ctx->error_every;
+
+	regmap = devm_regmap_init(ctx->dev, &sd151_stub_bus, ctx->stub, &config);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, regmap);
+
+	ctx->data.dev = ctx->dev;
+	ctx->data.regmap = regmap;
+	sd151_bus_init(&ctx->data);
+
+	test->priv = ctx;
+
+	return 0;
+}
+
+static void sd151_kunit_exit(struct kunit *test)
+{
+	struct sd151_kunit *ctx = test->priv;
+
+	/* Releases the model and its regmap */
+	if (ctx && !IS_ERR_OR_NULL(ctx->dev))
+		root_device_unregister(ctx->dev);
+}
+
+/****************************************************************************
+ * TESTS
+ ****************************************************************************/
+
+static void sd151_kunit_chip_id(struct kunit *test)
+{
+	struct sd151_kunit *ctx = test->priv;
+	unsigned int val;
+
+	KUNIT_ASSERT_EQ(test, 0, sd151_bus_read(&ctx->data,
+		SD151_BUS_INTERACTIVE, SD151_CHIP_ID_REG, &val));
+	KUNIT_EXPECT_EQ(test, val, (unsigned int)SD151_CHIP_ID);
+
+	KUNIT_ASSERT_EQ(test, 0, sd151_bus_read(&ctx->data,
+		SD151_BUS_INTERACTIVE, SD151_CHIP_VER_REG, &val));
+	KUNIT_EXPECT_EQ(test, val, (unsigned int)VERSION);
+
+	KUNIT_EXPECT_EQ(test, ctx->stub->xfers, 2ULL);
+}
+
+/* The 48 bit counter moves in one block transfer each way */
+static void sd151_kunit_rtc_block(struct kunit *test)
+{
+	struct sd151_kunit *ctx = test->priv;
+	const time64_t set = 0x123456789abcLL;
+	u16 regs[3] = { set & 0xffff, (set >> 16) & 0xffff, (set >> 32) & 0xffff };
+	time64_t got;
+
+	KUNIT_ASSERT_EQ(test, 0, sd151_bus_bulk_write(&ctx->data,
+		SD151_BUS_INTERACTIVE, SD151_RTC0, regs, ARRAY_SIZE(regs)));
+	memset(regs, 0, sizeof(regs));
+	KUNIT_ASSERT_EQ(test, 0, sd151_bus_bulk_read(&ctx->data,
+		SD151_BUS_INTERACTIVE, SD151_RTC0, regs, ARRAY_SIZE(regs)));
+
+	got = regs[0] | ((time64_t)regs[1] << 16) | ((time64_t)regs[2] << 32);
+	/* The counter may have ticked between the two transfers */
+	KUNIT_EXPECT_TRUE(test, got >= set && got <= set + 1);
+
+	KUNIT_EXPECT_EQ(test, ctx->stub->xfers, 2ULL);
+	KUNIT_EXPECT_EQ(test, ctx->stub->regs_written, 3ULL);
+	KUNIT_EXPECT_EQ(test, ctx->stub->regs_read, 3ULL);
+}
+
+static void sd151_kunit_wdog_command(struct kunit *test)
+{
+	struct sd151_kunit *ctx = test->priv;
+	unsigned int val;
+
+	KUNIT_ASSERT_EQ(test, 0, sd151_bus_write(&ctx->data, SD151_BUS_CRITICAL,
+		SD151_COMMAND, SD151_WDOG_ENABLE));
+	KUNIT_ASSERT_EQ(test, 0, sd151_bus_read(&ctx->data, SD151_BUS_CRITICAL,
+		SD151_STATUS, &val));
+	KUNIT_EXPECT_TRUE(test, val & SD151_STATUS_WDOG_EN);
+	KUNIT_EXPECT_TRUE(test, ctx->data.shadow.wdog_enabled);
+
+	KUNIT_ASSERT_EQ(test, 0, sd151_bus_write(&ctx->data, SD151_BUS_CRITICAL,
+		SD151_WDOG_REFRESH, SD151_WDOG_REFRESH_MAGIC_VALUE));
+	KUNIT_EXPECT_EQ(test, ctx->stub->refreshes, 1ULL);
+
+	KUNIT_ASSERT_EQ(test, 0, sd151_bus_write(&ctx->data, SD151_BUS_CRITICAL,
+		SD151_COMMAND, SD151_WDOG_DISABLE));
+	KUNIT_ASSERT_EQ(test, 0, sd151_bus_read(&ctx->data, SD151_BUS_CRITICAL,
+		SD151_STATUS, &val));
+	KUNIT_EXPECT_FALSE(test, val & SD151_STATUS_WDOG_EN);
+	KUNIT_EXPECT_FALSE(test, ctx->data.shadow.wdog_enabled);
+}
+
+static void sd151_kunit_error_inject(struct kunit *test)
+{
+	struct sd151_kunit *ctx = test->priv;
+	unsigned int val, i, failed = 0;
+
+	ctx->error_every = 3;
+	for (i = 0; i < 6; i++) {
+		if (sd151_bus_read(&ctx->data, SD151_BUS_BULK, SD151_CHIP_ID_REG,
+				&val) == -EIO)
+			failed++;
+	}
+
+	KUNIT_EXPECT_EQ(test, failed, 2U);
+	KUNIT_EXPECT_EQ(test, ctx->stub->errors, 2ULL);
+}
+
+static void sd151_kunit_mcu_reset(struct kunit *test)
+{
+	struct sd151_kunit *ctx = test->priv;
+	unsigned int val;
+
+	KUNIT_ASSERT_EQ(test, 0, regmap_write(ctx->data.regmap, SD151_STATUS, 0));
+	KUNIT_ASSERT_EQ(test, 0, sd151_stub_mcu_reset(ctx->stub, 1));
+
+	KUNIT_ASSERT_EQ(test, 0, regmap_read(ctx->data.regmap, SD151_STATUS, &val));
+	KUNIT_EXPECT_TRUE(test, val & SD151_STATUS_POWERUP);
+	/* The counter restarts from zero */
+	KUNIT_EXPECT_LE(test, sd151_stub_rtc(ctx->stub), (time64_t)1);
+	KUNIT_EXPECT_EQ(test, ctx->stub->mcu_resets, 1ULL);
+}
+
+static struct kunit_case sd151_kunit_cases[] = {
+	KUNIT_CASE(sd151_kunit_chip_id),
+	KUNIT_CASE(sd151_kunit_rtc_block),
+	KUNIT_CASE(sd151_kunit_wdog_command),
+	KUNIT_CASE(sd151_kunit_error_inject),
+	KUNIT_CASE(sd151_kunit_mcu_reset),
+	{ }
+};
+
+static struct kunit_suite sd151_kunit_suite = {
+	.name = "sd151",
+	.init = sd151_kunit_init,
+	.exit = sd151_kunit_exit,
+	.test_cases = sd151_kunit_cases,
+};
+
+kunit_test_suite(sd151_kunit_suite);
@@ -27,13 +27,59 @@
 
 #include <linux/module.h>
 #include <linux/proc_fs.h>	/* Necessary because we use the proc fs */
+#include <linux/capability.h>
+#include <linux/slab.h>
 
 #include "sd151.h"
 
 struct sd151_private *pdata;
 
-#define SD151_PROC_MSG_LEN               32
-#define SD151_PROC_BUFSIZE               512
+extern int sd151_wake_set(struct sd151_private *, const char *, time64_t, bool);
+extern int sd151_selftest(struct sd151_private *, unsigned int);
+extern int sd151_updi_start(struct sd151_private *, const char *);
+extern int sd151_bus_read(struct sd151_private *, int, unsigned int,
+	unsigned int *);
+extern int sd151_bus_write(struct sd151_private *, int, unsigned int,
+	unsigned int);
+
+#define SD151_PROC_MSG_LEN               64
+#define SD151_PROC_BUFSIZE               4096
+
+static const char * const sd151_bus_class_name[SD151_BUS_CLASSES] = {
+	"critical", "interact", "bulk",
+};
+
+/**
+ * @brief Handle a "wake <name> <when>" command
+ * @param [in] arg command arguments
+ * @return 0 on success.
+ * @details when is an RTC time in seconds, +seconds from now, or off.
+ */
+static int sd151_proc_wake(const char *arg)
+{
+	char name[SD151_WAKE_NAME_LEN];
+	char when[24];
+	long long t;
+	bool relative = false;
+	int ret;
+
+	if (sscanf(arg, "%15s %23s", name, when) != 2)
+		return -EINVAL;
+
+	if (strcmp(when, "off") == 0)
+		return sd151_wake_set(pdata, name, 0, false);
+
+	if (when[0] == '+')
+		relative = true;
+
+	ret = kstrtoll(when + relative, 10, &t);
+	if (ret)
+		return ret;
+	if (t <= 0)
+		return -EINVAL;
+
+	return sd151_wake_set(pdata, name, t, relative);
+}
 
 ssize_t sd151_proc_write( struct file *filp, const char __user *buff, size_t len, loff_t *data )
 {
@@ -48,14 +94,42 @@ ssize_t sd151_proc_write( struct file *filp, const char __user *buff, size_t len
   if (copy_from_user( cmd, buff, len ))
   	return -EFAULT;
 
-  if(strncmp(cmd,"buzzer-low",len-1)==0) {
-    ret = regmap_write(pdata->regmap, SD151_COMMAND, SD151_BUZZER_LOW);
+  if(strncmp(cmd,"wake ",5)==0) {
+    /* Power-on requests of every client share the slot */
+    if (!capable(CAP_SYS_ADMIN))
+      return -EPERM;
+    ret = sd151_proc_wake(cmd+5);
+    if (ret)
+      return ret;
+  } else if(strncmp(cmd,"selftest",8)==0) {
+    unsigned int count = SD151_SELFTEST_DEF_COUNT;
+
+    /* Holds the bus for up to SD151_SELFTEST_MAX_COUNT transfers */
+    if (!capable(CAP_SYS_ADMIN))
+      return -EPERM;
+    if (cmd[8] == ' ' && kstrtouint(strim(cmd+9), 10, &count))
+      return -EINVAL;
+    if (!count || count > SD151_SELFTEST_MAX_COUNT)
+      return -EINVAL;
+    /* The result is read back from the report, errors included */
+    sd151_selftest(pdata, count);
+  } else if(strncmp(cmd,"upgrade",7)==0) {
+    /* Reprograms the power management MCU */
+    if (!capable(CAP_SYS_ADMIN))
+      return -EPERM;
+    if (cmd[7] != ' ' && cmd[7] != '\n' && cmd[7] != 0)
+      return -EINVAL;
+    ret = sd151_updi_start(pdata, strim(cmd+7));
+    if (ret)
+      return ret;
+  } else if(strncmp(cmd,"buzzer-low",len-1)==0) {
+    ret = sd151_bus_write(pdata, SD151_BUS_INTERACTIVE, SD151_COMMAND, SD151_BUZZER_LOW);
   } else if(strncmp(cmd,"buzzer-high",len-1)==0) {
-		ret = regmap_write(pdata->regmap, SD151_COMMAND, SD151_BUZZER_HIGH);
+		ret = sd151_bus_write(pdata, SD151_BUS_INTERACTIVE, SD151_COMMAND, SD151_BUZZER_HIGH);
 	} else if(strncmp(cmd,"fan-on",len-1)==0) {
-		ret = regmap_write(pdata->regmap, SD151_COMMAND, SD151_FAN_FORCE_ENABLE);
+		ret = sd151_bus_write(pdata, SD151_BUS_INTERACTIVE, SD151_COMMAND, SD151_FAN_FORCE_ENABLE);
 	} else if(strncmp(cmd,"fan-off",len-1)==0) {
-		ret = regmap_write(pdata->regmap, SD151_COMMAND, SD151_FAN_RELASE_CONTROL);
+		ret = sd151_bus_write(pdata, SD151_BUS_INTERACTIVE, SD151_COMMAND, SD151_FAN_RELASE_CONTROL);
 	}
   else{
   	return -EFAULT;
@@ -65,23 +139,30 @@ ssize_t sd151_proc_write( struct file *filp, const char __user *buff, size_t len
 
 int sd151_proc_read( struct file *filp, char __user *ubuf, size_t count, loff_t *ppos )
 {
-	char buf[SD151_PROC_BUFSIZE];
+	char *buf;
 	int len=0;
 	int ret;
+	int i;
 	unsigned int status;
 
 	printk( KERN_INFO "read handler %p %d\n",ppos,count);
-	if(*ppos > 0 || count < SD151_PROC_BUFSIZE)
+	if(*ppos > 0)
 		return 0;
 
+	/* The report grows with the wake requests, keep it off the stack */
+	buf = kmalloc(SD151_PROC_BUFSIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
 	len += sprintf(buf+len, "\nModule      : sd151-hwmon");
 	len += sprintf(buf+len, "\nVersion     : %d",pdata->firmware_version);
 
 	/* get status */
-	ret = regmap_read(pdata->regmap, SD151_STATUS, &status);
+	ret = sd151_bus_read(pdata, SD151_BUS_BULK, SD151_STATUS, &status);
 	if (ret < 0) {
 		dev_err(pdata->dev, "failed to read I2C\n");
-		return -EFAULT;
+		len = -EFAULT;
+		goto out;
 	}
 	if (status&SD151_STATUS_WDOG_EN) {
 		len += sprintf(buf+len, "\nwdog        : enabled");
@@ -107,11 +188,79 @@ int sd151_proc_read( struct file *filp, char __user *ubuf, size_t count, loff_t
 		len += sprintf(buf+len, "\nbeep        : enabled");
 	}
 
+	len += sprintf(buf+len, "\ni2c clock   : %u Hz", pdata->bus_hz);
+	if (pdata->selftest.count) {
+		struct sd151_selftest *st = &pdata->selftest;
+		unsigned int ok = st->count - st->errors;
+
+		len += sprintf(buf+len, "\nselftest    : %u xfers, %u errors, %u bad values",
+			st->count, st->errors, st->mismatches);
+		len += sprintf(buf+len, "\nselftest lat: min %llu avg %llu max %llu us",
+			div_u64(st->min_ns, NSEC_PER_USEC),
+			ok ? div64_u64(st->total_ns, (u64)ok * NSEC_PER_USEC) : 0,
+			div_u64(st->max_ns, NSEC_PER_USEC));
+	}
+
+	for (i = 0; i < SD151_BUS_CLASSES; i++) {
+		struct sd151_bus_class *c = &pdata->bus.cls[i];
+
+		len += sprintf(buf+len, "\nbus %-8s: %lu xfers, wait avg %llu max %llu us, queue %u max %u",
+			sd151_bus_class_name[i], c->xfers,
+			c->xfers ? div64_u64(c->wait_ns, (u64)c->xfers * NSEC_PER_USEC) : 0,
+			div_u64(c->max_wait_ns, NSEC_PER_USEC), READ_ONCE(c->waiting),
+			c->max_depth);
+	}
+
+	if (pdata->reset.check_ms)
+		len += sprintf(buf+len, "\nfw resets   : %lu, last replay %llu us, rtc restored %lu",
+			pdata->reset.count, div_u64(pdata->reset.replay_ns, NSEC_PER_USEC),
+			pdata->reset.rtc_restored);
+	else
+		len += sprintf(buf+len, "\nfw resets   : detection disabled");
+
+	if (pdata->updi.phase) {
+		struct sd151_updi *u = &pdata->updi;
+
+		len += sprintf(buf+len, "\nupgrade     : %s %s, page %u/%u, %u retries",
+			u->fw_name, u->phase, u->page, u->pages, u->retries);
+		if (!u->running && u->result)
+			len += sprintf(buf+len, ", error %d", u->result);
+		len += sprintf(buf+len, "\nupdi        : %u baud, irq off max %llu us",
+			u->baud, div_u64(u->irqoff_max_ns, NSEC_PER_USEC));
+	}
+
+	if (pdata->wdmux.registered) {
+		len += sprintf(buf+len, "\nwdmux       : %u clients, %s",
+			pdata->wdmux.nclients,
+			READ_ONCE(pdata->wdmux.expired) ? "expired" : "healthy");
+	}
+
+	if (!IS_ERR_OR_NULL(pdata->rtc)) {
+		struct sd151_wake *wake;
+
+		mutex_lock(&pdata->rtc_lock);
+		len += sprintf(buf+len, "\nwakeup      : %lld (%lu writes, %lu skipped)",
+			pdata->wakeup_hw, pdata->wakeup_writes, pdata->wakeup_skipped);
+		list_for_each_entry(wake, &pdata->wake_list, list)
+			len += sprintf(buf+len, "\nwake        : %s at %lld",
+				wake->name, (long long)wake->node.expires);
+		mutex_unlock(&pdata->rtc_lock);
+
+		len += sprintf(buf+len, "\nrtc reads   : %lu hw, %lu cached",
+			pdata->rtc_cache.hw_reads, pdata->rtc_cache.cached_reads);
+		len += sprintf(buf+len, "\nrtc sync    : %lld us uncertainty, %lu resets",
+			div_s64(pdata->rtc_cache.err_ns, NSEC_PER_USEC),
+			pdata->rtc_cache.mismatches);
+		len += sprintf(buf+len, "\nrtc drift   : %lld ppb",
+			pdata->rtc_cache.drift_ppb);
+	}
+
 	/* get buttons */
-	ret = regmap_read(pdata->regmap, SD151_BUTTONS, &status);
+	ret = sd151_bus_read(pdata, SD151_BUS_BULK, SD151_BUTTONS, &status);
 	if (ret < 0) {
 		dev_err(pdata->dev, "failed to read I2C\n");
-		return -EFAULT;
+		len = -EFAULT;
+		goto out;
 	}
 	if (status&SD151_BUTTON_PRESS1)
 		len += sprintf(buf+len, "\nbutton-1    : enabled");
@@ -123,12 +272,16 @@ int sd151_proc_read( struct file *filp, char __user *ubuf, size_t count, loff_t
 		len += sprintf(buf+len, "\npower button: 2");
 	if ((status&(SD151_BUTTON_POWER2|SD151_BUTTON_POWER1))==0)
 		len += sprintf(buf+len, "\npower button: none");
+	if (pdata->inp.gestures)
+		len += sprintf(buf+len, "\ngestures    : on, %lu/%lu dropped presses",
+			pdata->inp.btn[0].glitches, pdata->inp.btn[1].glitches);
 
 	/* get FAN */
-	ret = regmap_read(pdata->regmap, SD151_FAN, &status);
+	ret = sd151_bus_read(pdata, SD151_BUS_BULK, SD151_FAN, &status);
 	if (ret < 0) {
 		dev_err(pdata->dev, "failed to read I2C\n");
-		return -EFAULT;
+		len = -EFAULT;
+		goto out;
 	}
 	if (status==0)
 		len += sprintf(buf+len, "\nFAN         : OFF");
@@ -143,10 +296,15 @@ int sd151_proc_read( struct file *filp, char __user *ubuf, size_t count, loff_t
 
 	len += sprintf(buf+len, "\nEnd of report.\n");
 
-	if(copy_to_user(ubuf,buf,len))
-		return -EFAULT;
+	len = min_t(size_t, len, count);
+	if(copy_to_user(ubuf,buf,len)) {
+		len = -EFAULT;
+		goto out;
+	}
 
 	*ppos = len;
+out:
+	kfree(buf);
 	return len;
 }
 
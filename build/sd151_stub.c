@@ -0,0 +1,370 @@
+/*
+ * sd151_stub.c - Part of OPEN-EYES PI-POW HAT product, Linux kernel modules
+ * for hardware monitoring
+ * This file implements a software model of the SD151 firmware registers.
+ * Author:
+ * Massimiliano Negretti <massimiliano.negretti@open-eyes.it> 2021-07-4
+ *
+ * The model is only built in the test configuration (make test, which sets
+ * CONFIG_SD151_TEST). Loading that module with stub=1 binds the driver to the
+ * register model instead of the I2C bus, so hwmon, proc, RTC and watchdog
+ * paths can be exercised without a PI-POW HAT. Any I2C adapter can host the
+ * client, the i2c-stub module is the usual choice:
+ *
+ *   modprobe i2c-stub chip_addr=0x35
+ *   insmod sd151-hwmon.ko stub=1
+ *   echo sd151 0x35 > /sys/bus/i2c/devices/i2c-<N>/new_device
+ *
+ * Every bus transaction of the model can be delayed (stub_latency_us) and
+ * made to fail (stub_error_every), and is counted in debugfs under sd151/.
+ * Writing debugfs sd151/mcu_reset restarts the model from its power-on state.
+ * test/sd151-stub.sh automates the setup and the transactions per operation
+ * measurement. When the kernel has KUnit, the suite in sd151_kunit.c runs on
+ * the model at module load.
+ *
+ * This file is part of sd151-hwmon distribution
+ * https://github.com/openeyes-lab/sd151-hwmon
+ *
+ * Copyright (c) 2021 OPEN-EYES Srl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/property.h>
+#include <linux/version.h>
+
+#include "sd151.h"
+
+bool sd151_stub_enabled;
+module_param_named(stub, sd151_stub_enabled, bool, 0444);
+MODULE_PARM_DESC(stub, "Bind to a software register model instead of the I2C chip");
+
+static unsigned int stub_latency_us;
+module_param(stub_latency_us, uint, 0644);
+MODULE_PARM_DESC(stub_latency_us, "Register model: delay of every bus transaction");
+
+static unsigned int stub_error_every;
+module_param(stub_error_every, uint, 0644);
+MODULE_PARM_DESC(stub_error_every, "Register model: fail one bus transaction every N (0 never)");
+
+struct sd151_stub {
+	struct device                 *dev;
+	/* The module parameters, or fixed values for the KUnit suite */
+	unsigned int                  *latency_us;
+	unsigned int                  *error_every;
+	u16                           regs[SD151_NUM_REGS];
+	time64_t                      rtc_offset;
+	struct dentry                 *debugfs;
+	/* Statistics, reset by writing 0 to the debugfs files */
+	u64                           xfers;
+	u64                           regs_read;
+	u64                           regs_written;
+	u64                           errors;
+	u64                           refreshes;
+	u64                           busy_ns;
+	u64                           mcu_resets;
+};
+
+/* Without overlay (new_device on i2c-stub) the model enables all features */
+static const struct property_entry sd151_stub_props[] = {
+	PROPERTY_ENTRY_BOOL("rtc_enabled"),
+	PROPERTY_ENTRY_BOOL("wdog_enabled"),
+	PROPERTY_ENTRY_U32("wdog_timeout", 15),
+	PROPERTY_ENTRY_U32("wdog_wait", 120),
+	{ }
+};
+
+/****************************************************************************
+ * REGISTER MODEL
+ ****************************************************************************/
+
+/*
+ * The RTC counter runs on the boot time clock, a write moves its offset.
+ * Writes to the other registers are stored; COMMAND only tracks the
+ * watchdog enable bit in STATUS.
+ */
+
+static time64_t sd151_stub_rtc(struct sd151_stub *stub)
+{
+	return (stub->rtc_offset + ktime_get_boottime_seconds()) & 0xffffffffffff;
+}
+
+static u16 sd151_stub_reg_read(struct sd151_stub *stub, unsigned int reg)
+{
+	switch (reg) {
+		case SD151_RTC0:
+		case SD151_RTC1:
+		case SD151_RTC2:
+			return (sd151_stub_rtc(stub) >> ((reg - SD151_RTC0) * 16)) & 0xffff;
+		default:
+			return stub->regs[reg];
+	}
+}
+
+static void sd151_stub_reg_write(struct sd151_stub *stub, unsigned int reg,
+	u16 val)
+{
+	time64_t rtc;
+	int shift;
+
+	switch (reg) {
+		case SD151_CHIP_ID_REG:
+		case SD151_CHIP_VER_REG:
+			break;
+		case SD151_COMMAND:
+			if (val == SD151_WDOG_ENABLE)
+				stub->regs[SD151_STATUS] |= SD151_STATUS_WDOG_EN;
+			else if (val == SD151_WDOG_DISABLE)
+				stub->regs[SD151_STATUS] &= ~SD151_STATUS_WDOG_EN;
+			else if (val == SD151_BUZZER_DISABLE)
+				stub->regs[SD151_STATUS] |= SD151_STATUS_BEEP_DISABLED;
+			else if (val == SD151_BUZZER_ENABLE)
+				stub->regs[SD151_STATUS] &= ~SD151_STATUS_BEEP_DISABLED;
+			break;
+		case SD151_WDOG_REFRESH:
+			if (val == SD151_WDOG_REFRESH_MAGIC_VALUE)
+				stub->refreshes++;
+			break;
+		case SD151_RTC0:
+		case SD151_RTC1:
+		case SD151_RTC2:
+			shift = (reg - SD151_RTC0) * 16;
+			rtc = sd151_stub_rtc(stub) & ~((time64_t)0xffff << shift);
+			rtc |= (time64_t)val << shift;
+			stub->rtc_offset = rtc - ktime_get_boottime_seconds();
+			break;
+		default:
+			stub->regs[reg] = val;
+			break;
+	}
+}
+
+static void sd151_stub_reset(struct sd151_stub *stub)
+{
+	stub->regs[SD151_CHIP_ID_REG] = SD151_CHIP_ID;
+	stub->regs[SD151_CHIP_VER_REG] = VERSION;
+	stub->regs[SD151_STATUS] = SD151_STATUS_POWERUP;
+	stub->regs[SD151_WDOG_TIMEOUT] = 15 | (120 << SD151_WDOG_WAIT_POS);
+	/* 5V board, 5V RPI and 3V3 RPI rails in mV: value, min, max */
+	stub->regs[SD151_VOLTAGE_5V_BOARD] = 5120;
+	stub->regs[SD151_VOLTAGE_5V_BOARD_MIN] = 5010;
+	stub->regs[SD151_VOLTAGE_5V_BOARD_MAX] = 5230;
+	stub->regs[SD151_VOLTAGE_5V_RPI] = 5050;
+	stub->regs[SD151_VOLTAGE_5V_RPI + 1] = 4940;
+	stub->regs[SD151_VOLTAGE_5V_RPI + 2] = 5150;
+	stub->regs[SD151_VOLTAGE_3V3_RPI] = 3310;
+	stub->regs[SD151_VOLTAGE_3V3_RPI + 1] = 3270;
+	stub->regs[SD151_VOLTAGE_3V3_RPI + 2] = 3350;
+	stub->rtc_offset = ktime_get_real_seconds() - ktime_get_boottime_seconds();
+}
+
+/* Power-on reset of the MCU, written from debugfs sd151/mcu_reset */
+static int sd151_stub_mcu_reset(void *context, u64 val)
+{
+	struct sd151_stub *stub = context;
+
+	memset(stub->regs, 0, sizeof(stub->regs));
+	sd151_stub_reset(stub);
+	/* The counter restarts from zero */
+	stub->rtc_offset = -ktime_get_boottime_seconds();
+	stub->mcu_resets++;
+
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(sd151_stub_reset_fops, NULL, sd151_stub_mcu_reset,
+	"%llu\n");
+
+/****************************************************************************
+ * REGMAP BUS
+ ****************************************************************************/
+
+/*
+ * One call of the bus is one I2C transaction, so a block transfer of the
+ * RTC words counts once, as it does on the wire.
+ */
+
+static int sd151_stub_xfer_begin(struct sd151_stub *stub)
+{
+	unsigned int latency = READ_ONCE(*stub->latency_us);
+	unsigned int every = READ_ONCE(*stub->error_every);
+
+	stub->xfers++;
+
+	if (latency) {
+		usleep_range(latency, latency + latency / 8 + 1);
+		stub->busy_ns += (u64)latency * NSEC_PER_USEC;
+	}
+
+	if (every && (stub->xfers % every) == 0) {
+		stub->errors++;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int sd151_stub_write(void *context, const void *data, size_t count)
+{
+	struct sd151_stub *stub = context;
+	const u8 *buf = data;
+	unsigned int reg = buf[0];
+	u16 val;
+	size_t i;
+	int ret;
+
+	ret = sd151_stub_xfer_begin(stub);
+	if (ret)
+		return ret;
+
+	for (i = 1; i + sizeof(val) <= count; i += sizeof(val), reg++) {
+		if (reg >= SD151_NUM_REGS)
+			return -EIO;
+		memcpy(&val, buf + i, sizeof(val));
+		sd151_stub_reg_write(stub, reg, val);
+		stub->regs_written++;
+	}
+
+	return 0;
+}
+
+static int sd151_stub_read(void *context, const void *reg_buf, size_t reg_size,
+	void *val_buf, size_t val_size)
+{
+	struct sd151_stub *stub = context;
+	unsigned int reg = *(const u8 *)reg_buf;
+	u8 *buf = val_buf;
+	u16 val;
+	size_t i;
+	int ret;
+
+	ret = sd151_stub_xfer_begin(stub);
+	if (ret)
+		return ret;
+
+	for (i = 0; i + sizeof(val) <= val_size; i += sizeof(val), reg++) {
+		if (reg >= SD151_NUM_REGS)
+			return -EIO;
+		val = sd151_stub_reg_read(stub, reg);
+		memcpy(buf + i, &val, sizeof(val));
+		stub->regs_read++;
+	}
+
+	return 0;
+}
+
+static const struct regmap_bus sd151_stub_bus = {
+	.write = sd151_stub_write,
+	.read = sd151_stub_read,
+	.reg_format_endian_default = REGMAP_ENDIAN_NATIVE,
+	.val_format_endian_default = REGMAP_ENDIAN_NATIVE,
+};
+
+/****************************************************************************
+ * STUB INITIALIZATION
+ ****************************************************************************/
+
+static void sd151_stub_release(void *context)
+{
+	struct sd151_stub *stub = context;
+
+	debugfs_remove_recursive(stub->debugfs);
+}
+
+/*
+ * Device managed model in its power-on state, shared with the KUnit suite.
+ * The counters are published in debugfs under debugfs_name unless NULL.
+ */
+static struct sd151_stub *sd151_stub_create(struct device *dev,
+	const char *debugfs_name)
+{
+	struct sd151_stub *stub;
+	int ret;
+
+	stub = devm_kzalloc(dev, sizeof(*stub), GFP_KERNEL);
+	if (!stub)
+		return ERR_PTR(-ENOMEM);
+
+	stub->dev = dev;
+	stub->latency_us = &stub_latency_us;
+	stub->error_every = &stub_error_every;
+	sd151_stub_reset(stub);
+
+	if (!dev_fwnode(dev)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
+		ret = device_create_managed_software_node(dev, sd151_stub_props, NULL);
+#else
+		ret = device_add_properties(dev, sd151_stub_props);
+#endif
+		if (ret)
+			dev_warn(dev, "register model: no default properties\n");
+	}
+
+	if (!debugfs_name)
+		goto done;
+
+	stub->debugfs = debugfs_create_dir(debugfs_name, NULL);
+	debugfs_create_u64("xfers", 0644, stub->debugfs, &stub->xfers);
+	debugfs_create_u64("regs_read", 0644, stub->debugfs, &stub->regs_read);
+	debugfs_create_u64("regs_written", 0644, stub->debugfs,
+		&stub->regs_written);
+	debugfs_create_u64("errors", 0644, stub->debugfs, &stub->errors);
+	debugfs_create_u64("wdog_refreshes", 0644, stub->debugfs,
+		&stub->refreshes);
+	debugfs_create_u64("busy_ns", 0644, stub->debugfs, &stub->busy_ns);
+	debugfs_create_u64("mcu_resets", 0644, stub->debugfs, &stub->mcu_resets);
+	debugfs_create_file_unsafe("mcu_reset", 0200, stub->debugfs, stub,
+		&sd151_stub_reset_fops);
+
+done:
+	ret = devm_add_action_or_reset(dev, sd151_stub_release, stub);
+	if (ret)
+		return ERR_PTR(ret);
+
+	return stub;
+}
+
+/**
+ * @brief Create the register model regmap
+ * @param [in] client i2c client the driver is bound to
+ * @param [in] config regmap configuration
+ * @return regmap pointer or ERR_PTR
+ * @details The regmap is device managed, as devm_regmap_init_i2c.
+ */
+struct regmap *sd151_stub_regmap_init(struct i2c_client *client,
+	const struct regmap_config *config)
+{
+	struct device *dev = &client->dev;
+	struct sd151_stub *stub;
+
+	stub = sd151_stub_create(dev, "sd151");
+	if (IS_ERR(stub))
+		return ERR_CAST(stub);
+
+	dev_info(dev, "using the register model, latency %uus, error every %u\n",
+		stub_latency_us, stub_error_every);
+
+	return devm_regmap_init(dev, &sd151_stub_bus, stub, config);
+}
+
+EXPORT_SYMBOL_GPL(sd151_stub_regmap_init);
+
+#if IS_ENABLED(CONFIG_KUNIT)
+#include "sd151_kunit.c"
+#endif
@@ -0,0 +1,704 @@
+/*
+ * sd151_updi.c - Part of OPEN-EYES PI-POW HAT product, Linux kernel modules
+ * for hardware monitoring
+ * This file implements the SD151 firmware upgrade through UPDI.
+ * Author:
+ * Massimiliano Negretti <massimiliano.negretti@open-eyes.it> 2021-07-4
+ *
+ * The UPDI pin of the ATtiny817 is wired to UPDI_GPIO. The driver bit-bangs
+ * it with every frame timed on ktime deadlines with interrupts off, so the
+ * bit edges do not depend on the scheduler as in firmware/sd151upgrade.
+ * The image is a raw binary of the flash (objcopy -I ihex -O binary) loaded
+ * with request_firmware(), the upgrade is started from /proc/sd151:
+ *
+ *   echo "upgrade [sd151.bin]" > /proc/sd151
+ *
+ * All register traffic is paused during the upgrade. The MCU restarts with
+ * its default configuration, which the firmware reset detection replays.
+ *
+ * This file is part of sd151-hwmon distribution
+ * https://github.com/openeyes-lab/sd151-hwmon
+ *
+ * Copyright (c) 2021 OPEN-EYES Srl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/module.h>
+#include <linux/delay.h>
+#include <linux/firmware.h>
+#include <linux/bitops.h>
+#include <linux/irqflags.h>
+#include <linux/ktime.h>
+
+#include "sd151.h"
+
+extern int sd151_bus_read(struct sd151_private *, int, unsigned int,
+	unsigned int *);
+extern void sd151_bus_pause(struct sd151_private *, bool);
+extern void sd151_reset_check(struct sd151_private *);
+#ifdef CONFIG_SD151_TEST
+extern bool sd151_stub_enabled;
+#else
+#define sd151_stub_enabled              false
+#endif
+
+/* ATtiny817 */
+#define SD151_UPDI_FLASH_START          0x8000
+#define SD151_UPDI_FLASH_SIZE           (8 * 1024)
+#define SD151_UPDI_PAGE_SIZE            64
+#define SD151_UPDI_NVMCTRL              0x1000
+
+#define SD151_UPDI_RETRIES              3
+/* Bytes read per interrupts off section */
+#define SD151_UPDI_CHUNK                16
+/* Answer timeout: guard time (128 bits) plus margin, then between bytes */
+#define SD151_UPDI_RX_FIRST_BITS        400
+#define SD151_UPDI_RX_NEXT_BITS         100
+#define SD151_UPDI_NVM_TIMEOUT_MS       10000
+#define SD151_UPDI_BOOT_MS              200
+
+/* UPDI instruction set, as firmware/updi.h */
+#define UPDI_SYNC                       0x55
+#define UPDI_ACK                        0x40
+
+#define UPDI_LDS                        0x00
+#define UPDI_STS                        0x40
+#define UPDI_LD                         0x20
+#define UPDI_ST                         0x60
+#define UPDI_LDCS                       0x80
+#define UPDI_STCS                       0xC0
+#define UPDI_REPEAT                     0xA0
+#define UPDI_KEY                        0xE0
+
+#define UPDI_PTR_INC                    0x04
+#define UPDI_PTR_ADDRESS                0x08
+#define UPDI_ADDRESS_16                 0x04
+#define UPDI_DATA_8                     0x00
+#define UPDI_DATA_16                    0x01
+#define UPDI_REPEAT_WORD                0x01
+#define UPDI_KEY_64                     0x00
+
+#define UPDI_CS_STATUSA                 0x00
+#define UPDI_CS_CTRLA                   0x02
+#define UPDI_CS_CTRLB                   0x03
+#define UPDI_ASI_KEY_STATUS             0x07
+#define UPDI_ASI_RESET_REQ              0x08
+#define UPDI_ASI_SYS_STATUS             0x0B
+
+#define UPDI_CTRLA_IBDLY                BIT(7)
+#define UPDI_CTRLB_CCDETDIS             BIT(3)
+#define UPDI_CTRLB_UPDIDIS              BIT(2)
+#define UPDI_KEY_STATUS_NVMPROG         BIT(4)
+#define UPDI_SYS_STATUS_NVMPROG         BIT(3)
+#define UPDI_SYS_STATUS_LOCKSTATUS      BIT(0)
+#define UPDI_RESET_REQ_VALUE            0x59
+#define UPDI_KEY_NVM                    "NVMProg "
+
+#define UPDI_NVMCTRL_CTRLA              0x00
+#define UPDI_NVMCTRL_STATUS             0x02
+#define UPDI_NVMCTRL_WRITE_PAGE         0x01
+#define UPDI_NVMCTRL_PAGE_BUFFER_CLR    0x04
+#define UPDI_NVMCTRL_CHIP_ERASE         0x05
+#define UPDI_NVM_STATUS_WRITE_ERROR     BIT(2)
+#define UPDI_NVM_STATUS_BUSY            (BIT(0) | BIT(1))
+
+/****************************************************************************
+ * PHY
+ ****************************************************************************/
+
+/*
+ * Frames are 8E2. Each edge has an absolute deadline, busy waited with
+ * interrupts off, so a late edge does not shift the rest of the frame. Only
+ * the pin value is set and sampled there, a GPIO controller that can sleep
+ * is refused. The direction is switched with interrupts on; the target
+ * answers one guard time (128 bits) after the command, a turnaround later
+ * than that is caught by the timeout and retried. The interrupts off window
+ * grows with the bit time, updi_baud is kept above SD151_MIN_UPDI_BAUD.
+ */
+
+static inline void sd151_updi_wait(u64 *t, u32 ns)
+{
+	*t += ns;
+	while (ktime_get_ns() < *t)
+		cpu_relax();
+}
+
+static void sd151_updi_tx_byte(struct sd151_updi *u, u8 b, u64 *t)
+{
+	int i;
+
+	gpio_set_value(UPDI_GPIO, 0);
+	sd151_updi_wait(t, u->bit_ns);
+
+	for (i = 0; i < 8; i++) {
+		gpio_set_value(UPDI_GPIO, (b >> i) & 1);
+		sd151_updi_wait(t, u->bit_ns);
+	}
+
+	/* Even parity, then 2 stop bits */
+	gpio_set_value(UPDI_GPIO, hweight8(b) & 1);
+	sd151_updi_wait(t, u->bit_ns);
+	gpio_set_value(UPDI_GPIO, 1);
+	sd151_updi_wait(t, 2 * u->bit_ns);
+}
+
+static int sd151_updi_rx_byte(struct sd151_updi *u, u8 *b, u32 timeout_bits)
+{
+	u64 end = ktime_get_ns() + (u64)timeout_bits * u->bit_ns;
+	u64 t;
+	u8 v = 0;
+	int parity;
+	int i;
+
+	while (gpio_get_value(UPDI_GPIO)) {
+		if (ktime_get_ns() > end)
+			return -ETIMEDOUT;
+	}
+
+	/* Sample in the middle of the bits */
+	t = ktime_get_ns() + u->bit_ns / 2;
+	for (i = 0; i < 8; i++) {
+		sd151_updi_wait(&t, u->bit_ns);
+		if (gpio_get_value(UPDI_GPIO))
+			v |= BIT(i);
+	}
+
+	sd151_updi_wait(&t, u->bit_ns);
+	parity = gpio_get_value(UPDI_GPIO) ? 1 : 0;
+	sd151_updi_wait(&t, u->bit_ns);
+	if (!gpio_get_value(UPDI_GPIO) || parity != (hweight8(v) & 1))
+		return -EIO;
+
+	*b = v;
+
+	return 0;
+}
+
+/**
+ * @brief Send a command and receive its answer
+ * @param [in] u struct sd151_updi pointer
+ * @param [in] tx bytes to send
+ * @param [in] txlen number of bytes to send
+ * @param [out] rx answer buffer
+ * @param [in] rxlen number of bytes expected
+ * @return 0 on success.
+ */
+static int sd151_updi_xfer(struct sd151_updi *u, const u8 *tx, int txlen,
+	u8 *rx, int rxlen)
+{
+	unsigned long flags;
+	u64 t0, t;
+	int ret = 0;
+	int i;
+
+	if (txlen) {
+		gpio_direction_output(UPDI_GPIO, 1);
+		local_irq_save(flags);
+		t0 = t = ktime_get_ns();
+		/* One idle bit before the start bit */
+		sd151_updi_wait(&t, u->bit_ns);
+		for (i = 0; i < txlen; i++)
+			sd151_updi_tx_byte(u, tx[i], &t);
+		t = ktime_get_ns() - t0;
+		local_irq_restore(flags);
+		u->irqoff_max_ns = max(u->irqoff_max_ns, t);
+	}
+
+	if (rxlen) {
+		gpio_direction_input(UPDI_GPIO);
+		local_irq_save(flags);
+		t0 = ktime_get_ns();
+		for (i = 0; i < rxlen && !ret; i++)
+			ret = sd151_updi_rx_byte(u, &rx[i], i ? SD151_UPDI_RX_NEXT_BITS :
+				SD151_UPDI_RX_FIRST_BITS);
+		t = ktime_get_ns() - t0;
+		local_irq_restore(flags);
+		u->irqoff_max_ns = max(u->irqoff_max_ns, t);
+	}
+
+	return ret;
+}
+
+/* BREAK is a long zero: a double break resets the UPDI state machine */
+static void sd151_updi_double_break(void)
+{
+	gpio_direction_output(UPDI_GPIO, 0);
+	msleep(40);
+	gpio_set_value(UPDI_GPIO, 1);
+	msleep(50);
+	gpio_set_value(UPDI_GPIO, 0);
+	msleep(40);
+	gpio_set_value(UPDI_GPIO, 1);
+	msleep(10);
+}
+
+/****************************************************************************
+ * LINK
+ ****************************************************************************/
+
+static int sd151_updi_ack(int ret, u8 ack)
+{
+	if (ret)
+		return ret;
+
+	return (ack == UPDI_ACK) ? 0 : -EIO;
+}
+
+static int sd151_updi_stcs(struct sd151_updi *u, u8 reg, u8 val)
+{
+	u8 cmd[] = { UPDI_SYNC, UPDI_STCS | (reg & 0x0f), val };
+
+	return sd151_updi_xfer(u, cmd, sizeof(cmd), NULL, 0);
+}
+
+static int sd151_updi_ldcs(struct sd151_updi *u, u8 reg, u8 *val)
+{
+	u8 cmd[] = { UPDI_SYNC, UPDI_LDCS | (reg & 0x0f) };
+
+	return sd151_updi_xfer(u, cmd, sizeof(cmd), val, 1);
+}
+
+static int sd151_updi_lds(struct sd151_updi *u, u16 addr, u8 *val)
+{
+	u8 cmd[] = { UPDI_SYNC, UPDI_LDS | UPDI_ADDRESS_16 | UPDI_DATA_8,
+		addr & 0xff, addr >> 8 };
+
+	return sd151_updi_xfer(u, cmd, sizeof(cmd), val, 1);
+}
+
+static int sd151_updi_sts(struct sd151_updi *u, u16 addr, u8 val)
+{
+	u8 cmd[] = { UPDI_SYNC, UPDI_STS | UPDI_ADDRESS_16 | UPDI_DATA_8,
+		addr & 0xff, addr >> 8 };
+	u8 ack = 0;
+	int ret;
+
+	ret = sd151_updi_ack(sd151_updi_xfer(u, cmd, sizeof(cmd), &ack, 1), ack);
+	if (ret)
+		return ret;
+
+	return sd151_updi_ack(sd151_updi_xfer(u, &val, 1, &ack, 1), ack);
+}
+
+static int sd151_updi_st_ptr(struct sd151_updi *u, u16 addr)
+{
+	u8 cmd[] = { UPDI_SYNC, UPDI_ST | UPDI_PTR_ADDRESS | UPDI_DATA_16,
+		addr & 0xff, addr >> 8 };
+	u8 ack = 0;
+
+	return sd151_updi_ack(sd151_updi_xfer(u, cmd, sizeof(cmd), &ack, 1), ack);
+}
+
+static int sd151_updi_repeat(struct sd151_updi *u, u16 count)
+{
+	u8 cmd[] = { UPDI_SYNC, UPDI_REPEAT | UPDI_REPEAT_WORD,
+		(count - 1) & 0xff, (count - 1) >> 8 };
+
+	return sd151_updi_xfer(u, cmd, sizeof(cmd), NULL, 0);
+}
+
+static int sd151_updi_st_ptr_inc(struct sd151_updi *u, const u8 *data,
+	int len)
+{
+	u8 cmd[] = { UPDI_SYNC, UPDI_ST | UPDI_PTR_INC | UPDI_DATA_8, data[0] };
+	u8 ack = 0;
+	int ret;
+	int i;
+
+	ret = sd151_updi_ack(sd151_updi_xfer(u, cmd, sizeof(cmd), &ack, 1), ack);
+	for (i = 1; !ret && i < len; i++)
+		ret = sd151_updi_ack(sd151_updi_xfer(u, &data[i], 1, &ack, 1), ack);
+
+	return ret;
+}
+
+static int sd151_updi_ld_ptr_inc(struct sd151_updi *u, u8 *data, int len)
+{
+	u8 cmd[] = { UPDI_SYNC, UPDI_LD | UPDI_PTR_INC | UPDI_DATA_8 };
+
+	return sd151_updi_xfer(u, cmd, sizeof(cmd), data, len);
+}
+
+static int sd151_updi_key(struct sd151_updi *u, const char *key)
+{
+	u8 cmd[2 + 8] = { UPDI_SYNC, UPDI_KEY | UPDI_KEY_64 };
+	int i;
+
+	/* The key is sent last byte first */
+	for (i = 0; i < 8; i++)
+		cmd[2 + i] = key[7 - i];
+
+	return sd151_updi_xfer(u, cmd, sizeof(cmd), NULL, 0);
+}
+
+static int sd151_updi_reset(struct sd151_updi *u)
+{
+	int ret = sd151_updi_stcs(u, UPDI_ASI_RESET_REQ, UPDI_RESET_REQ_VALUE);
+
+	if (ret)
+		return ret;
+
+	return sd151_updi_stcs(u, UPDI_ASI_RESET_REQ, 0x00);
+}
+
+/**
+ * @brief Bring up the link and enter NVM programming mode
+ * @param [in] u struct sd151_updi pointer
+ * @return 0 on success.
+ */
+static int sd151_updi_progmode(struct sd151_updi *u)
+{
+	u8 status = 0;
+	int ret = -EIO;
+	int tries, i;
+
+	for (tries = 0; tries < SD151_UPDI_RETRIES; tries++) {
+		sd151_updi_double_break();
+
+		/* Collision detection off, inter-byte delay on answers */
+		sd151_updi_stcs(u, UPDI_CS_CTRLB, UPDI_CTRLB_CCDETDIS);
+		sd151_updi_stcs(u, UPDI_CS_CTRLA, UPDI_CTRLA_IBDLY);
+
+		ret = sd151_updi_ldcs(u, UPDI_CS_STATUSA, &status);
+		if (ret || !status) {
+			ret = -EIO;
+			continue;
+		}
+
+		ret = sd151_updi_ldcs(u, UPDI_ASI_SYS_STATUS, &status);
+		if (!ret && (status & UPDI_SYS_STATUS_NVMPROG))
+			return 0;
+
+		sd151_updi_key(u, UPDI_KEY_NVM);
+		ret = sd151_updi_ldcs(u, UPDI_ASI_KEY_STATUS, &status);
+		if (ret || !(status & UPDI_KEY_STATUS_NVMPROG)) {
+			ret = -EACCES;
+			continue;
+		}
+
+		sd151_updi_reset(u);
+
+		/* The device boots locked until the key is applied */
+		for (i = 0; i < 100; i++) {
+			usleep_range(1000, 1200);
+			ret = sd151_updi_ldcs(u, UPDI_ASI_SYS_STATUS, &status);
+			if (!ret && !(status & UPDI_SYS_STATUS_LOCKSTATUS))
+				break;
+		}
+
+		if (!ret && (status & UPDI_SYS_STATUS_NVMPROG))
+			return 0;
+		ret = -EIO;
+	}
+
+	return ret;
+}
+
+/* Reset the MCU out of programming mode and disable UPDI */
+static void sd151_updi_leave(struct sd151_updi *u)
+{
+	sd151_updi_reset(u);
+	sd151_updi_stcs(u, UPDI_CS_CTRLB, UPDI_CTRLB_UPDIDIS | UPDI_CTRLB_CCDETDIS);
+}
+
+/****************************************************************************
+ * NVM
+ ****************************************************************************/
+
+static int sd151_updi_nvm_wait(struct sd151_updi *u)
+{
+	unsigned long end = jiffies + msecs_to_jiffies(SD151_UPDI_NVM_TIMEOUT_MS);
+	u8 status;
+	int ret;
+
+	do {
+		ret = sd151_updi_lds(u, SD151_UPDI_NVMCTRL + UPDI_NVMCTRL_STATUS,
+			&status);
+		if (!ret) {
+			if (status & UPDI_NVM_STATUS_WRITE_ERROR)
+				return -EIO;
+			if (!(status & UPDI_NVM_STATUS_BUSY))
+				return 0;
+		}
+		usleep_range(200, 300);
+	} while (time_before(jiffies, end));
+
+	return -ETIMEDOUT;
+}
+
+static int sd151_updi_nvm_cmd(struct sd151_updi *u, u8 cmd)
+{
+	int ret = sd151_updi_nvm_wait(u);
+
+	if (ret)
+		return ret;
+
+	ret = sd151_updi_sts(u, SD151_UPDI_NVMCTRL + UPDI_NVMCTRL_CTRLA, cmd);
+	if (ret)
+		return ret;
+
+	return sd151_updi_nvm_wait(u);
+}
+
+static int sd151_updi_page_write(struct sd151_updi *u, u16 addr,
+	const u8 *data)
+{
+	int ret;
+
+	ret = sd151_updi_nvm_cmd(u, UPDI_NVMCTRL_PAGE_BUFFER_CLR);
+	if (ret)
+		return ret;
+
+	/* Fill the page buffer by writing to the page addresses */
+	ret = sd151_updi_st_ptr(u, addr);
+	if (!ret)
+		ret = sd151_updi_repeat(u, SD151_UPDI_PAGE_SIZE);
+	if (!ret)
+		ret = sd151_updi_st_ptr_inc(u, data, SD151_UPDI_PAGE_SIZE);
+	if (ret)
+		return ret;
+
+	return sd151_updi_nvm_cmd(u, UPDI_NVMCTRL_WRITE_PAGE);
+}
+
+static int sd151_updi_page_read(struct sd151_updi *u, u16 addr, u8 *data)
+{
+	int ret = 0;
+	int i;
+
+	for (i = 0; !ret && i < SD151_UPDI_PAGE_SIZE; i += SD151_UPDI_CHUNK) {
+		ret = sd151_updi_st_ptr(u, addr + i);
+		if (!ret)
+			ret = sd151_updi_repeat(u, SD151_UPDI_CHUNK);
+		if (!ret)
+			ret = sd151_updi_ld_ptr_inc(u, data + i, SD151_UPDI_CHUNK);
+	}
+
+	return ret;
+}
+
+/****************************************************************************
+ * UPGRADE
+ ****************************************************************************/
+
+/* Erase, write and verify the image, with the link already up */
+static int sd151_updi_flash(struct sd151_updi *u, const struct firmware *fw)
+{
+	u8 page[SD151_UPDI_PAGE_SIZE];
+	u8 rd[SD151_UPDI_PAGE_SIZE];
+	size_t off, n;
+	u16 addr;
+	int tries;
+	int ret;
+	int i;
+
+	u->phase = "erase";
+	ret = sd151_updi_nvm_cmd(u, UPDI_NVMCTRL_CHIP_ERASE);
+	if (ret)
+		return ret;
+
+	u->phase = "write";
+	for (i = 0; i < u->pages; i++) {
+		off = i * SD151_UPDI_PAGE_SIZE;
+		n = min_t(size_t, fw->size - off, SD151_UPDI_PAGE_SIZE);
+		memset(page, 0xff, sizeof(page));
+		memcpy(page, fw->data + off, n);
+		addr = SD151_UPDI_FLASH_START + off;
+
+		for (tries = 0; tries < SD151_UPDI_RETRIES; tries++) {
+			ret = sd151_updi_page_write(u, addr, page);
+			if (!ret)
+				break;
+			u->retries++;
+		}
+		if (ret)
+			return ret;
+
+		u->page = i + 1;
+	}
+
+	u->phase = "verify";
+	u->page = 0;
+	for (i = 0; i < u->pages; i++) {
+		off = i * SD151_UPDI_PAGE_SIZE;
+		n = min_t(size_t, fw->size - off, SD151_UPDI_PAGE_SIZE);
+		addr = SD151_UPDI_FLASH_START + off;
+
+		for (tries = 0; tries < SD151_UPDI_RETRIES; tries++) {
+			ret = sd151_updi_page_read(u, addr, rd);
+			if (!ret)
+				break;
+			u->retries++;
+		}
+		if (ret)
+			return ret;
+		if (memcmp(rd, fw->data + off, n))
+			return -EIO;
+
+		u->page = i + 1;
+	}
+
+	return 0;
+}
+
+static void sd151_updi_work(struct work_struct *work)
+{
+	struct sd151_updi *u = container_of(work, struct sd151_updi, work);
+	struct sd151_private *data = container_of(u, struct sd151_private, updi);
+	const struct firmware *fw;
+	unsigned int val;
+	int ret;
+
+	ret = request_firmware(&fw, u->fw_name, data->dev);
+	if (ret)
+		goto out;
+
+	if (!fw->size || fw->size > SD151_UPDI_FLASH_SIZE) {
+		dev_err(data->dev, "%s: bad image size %zu\n", u->fw_name, fw->size);
+		ret = -EINVAL;
+		goto release;
+	}
+
+	ret = gpio_request(UPDI_GPIO, "SD151_UPDI");
+	if (ret) {
+		dev_err(data->dev, "ERROR: GPIO %d request\n", UPDI_GPIO);
+		goto release;
+	}
+
+	/* The bits are timed with interrupts off */
+	if (gpio_cansleep(UPDI_GPIO)) {
+		dev_err(data->dev, "GPIO %d can sleep, no UPDI\n", UPDI_GPIO);
+		gpio_free(UPDI_GPIO);
+		ret = -EOPNOTSUPP;
+		goto release;
+	}
+
+	u->bit_ns = DIV_ROUND_CLOSEST(NSEC_PER_SEC, u->baud);
+	u->pages = DIV_ROUND_UP(fw->size, SD151_UPDI_PAGE_SIZE);
+	u->page = 0;
+	u->retries = 0;
+	u->irqoff_max_ns = 0;
+
+	dev_info(data->dev, "upgrading firmware with %s, %zu bytes at %u baud\n",
+		u->fw_name, fw->size, u->baud);
+
+	/* The MCU stops answering on I2C, and its watchdog with it */
+	sd151_bus_pause(data, true);
+	if (data->wdd.ops)
+		hrtimer_cancel(&data->pretimeout_timer);
+
+	u->phase = "link";
+	ret = sd151_updi_progmode(u);
+	if (!ret)
+		ret = sd151_updi_flash(u, fw);
+
+	sd151_updi_leave(u);
+	gpio_direction_input(UPDI_GPIO);
+	gpio_free(UPDI_GPIO);
+
+	msleep(SD151_UPDI_BOOT_MS);
+	sd151_bus_pause(data, false);
+
+	if (!sd151_bus_read(data, SD151_BUS_INTERACTIVE, SD151_CHIP_VER_REG, &val))
+		data->firmware_version = val;
+
+	/* Put back the configuration the new firmware booted without */
+	sd151_reset_check(data);
+
+release:
+	release_firmware(fw);
+out:
+	u->result = ret;
+	u->phase = ret ? "failed" : "done";
+	if (ret)
+		dev_err(data->dev, "firmware upgrade failed: %d\n", ret);
+	else
+		dev_info(data->dev, "firmware upgraded to version %d\n",
+			data->firmware_version);
+	WRITE_ONCE(u->running, false);
+}
+
+/**
+ * @brief Start a firmware upgrade
+ * @param [in] data struct sd151_private pointer
+ * @param [in] name firmware file in /lib/firmware, NULL for the default
+ * @return 0 if the upgrade was started.
+ * @details The upgrade runs in a work item, progress and result are shown
+ * in /proc/sd151.
+ */
+int sd151_updi_start(struct sd151_private *data, const char *name)
+{
+	struct sd151_updi *u = &data->updi;
+	int ret = 0;
+
+	/* The register model has no UPDI pin behind it */
+	if (sd151_stub_enabled)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&u->lock);
+
+	if (u->running) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	strscpy(u->fw_name, (name && *name) ? name : SD151_DEF_UPDI_FW,
+		sizeof(u->fw_name));
+	u->running = true;
+	u->phase = "queued";
+	u->page = 0;
+	u->pages = 0;
+	queue_work(system_long_wq, &u->work);
+
+out:
+	mutex_unlock(&u->lock);
+
+	return ret;
+}
+
+EXPORT_SYMBOL_GPL(sd151_updi_start);
+
+/****************************************************************************
+ * UPDI INITIALIZATION
+ ****************************************************************************/
+
+void sd151_updi_init(struct sd151_private *data)
+{
+	struct sd151_updi *u = &data->updi;
+
+	INIT_WORK(&u->work, sd151_updi_work);
+	mutex_init(&u->lock);
+
+	if (device_property_read_u32(data->dev, "updi_baud", &u->baud) ||
+			!u->baud)
+		u->baud = SD151_DEF_UPDI_BAUD;
+
+	if (u->baud < SD151_MIN_UPDI_BAUD) {
+		dev_warn(data->dev, "updi_baud %u too low, using %u\n", u->baud,
+			SD151_MIN_UPDI_BAUD);
+		u->baud = SD151_MIN_UPDI_BAUD;
+	}
+}
+
+EXPORT_SYMBOL_GPL(sd151_updi_init);
+
+void sd151_updi_remove(struct sd151_private *data)
+{
+	/* An upgrade in progress is completed, the MCU must not be left blank */
+	flush_work(&data->updi.work);
+}
+
+EXPORT_SYMBOL_GPL(sd151_updi_remove);
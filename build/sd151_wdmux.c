@@ -0,0 +1,457 @@
+/*
+ * sd151_wdmux.c - Part of OPEN-EYES PI-POW HAT product, Linux kernel modules
+ * for hardware monitoring
+ * This driver handles the SD151 watchdog multiplexer.
+ * Author:
+ * Massimiliano Negretti <massimiliano.negretti@open-eyes.it> 2021-07-4
+ *
+ * Every open of /dev/sd151_wdmux registers a named health client with its
+ * own deadline. The hardware watchdog is pinged only while all registered
+ * clients are healthy; a client that misses its deadline, or closes without
+ * the magic 'V', stops the pings and the MCU resets the board.
+ *
+ * The client file descriptor speaks the standard watchdog API
+ * (WDIOC_KEEPALIVE, WDIOC_SETTIMEOUT, magic close), so existing watchdog
+ * tools can be pointed at it. Writing "name=<client>" sets the client name.
+ *
+ * This file is part of sd151-hwmon distribution
+ * https://github.com/openeyes-lab/sd151-hwmon
+ *
+ * Copyright (c) 2021 OPEN-EYES Srl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/kref.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
+
+#include "sd151.h"
+
+#define SD151_WDMUX_CMD_LEN             32
+
+extern int sd151_wdog_hw_ping(struct sd151_private *);
+extern int sd151_bus_read(struct sd151_private *, int, unsigned int,
+	unsigned int *);
+extern int sd151_bus_write(struct sd151_private *, int, unsigned int,
+	unsigned int);
+
+/*
+ * A client is referenced by its file and, while registered, by the mux
+ * list. client->data is cleared when the device is removed, the files left
+ * open then only fail their operations until they are closed.
+ */
+struct sd151_wdmux_client {
+	struct kref                   ref;
+	struct list_head              list;
+	struct sd151_private          *data;
+	char                          name[SD151_WDMUX_NAME_LEN];
+	unsigned int                  timeout;
+	unsigned long                 deadline;
+	bool                          expect_close;
+	bool                          expired;
+};
+
+/* Keeps client->data valid against sd151_wdmux_remove() */
+static DEFINE_MUTEX(sd151_wdmux_detach);
+
+static const struct watchdog_info sd151_wdmux_info = {
+	.options = WDIOF_KEEPALIVEPING | WDIOF_MAGICCLOSE | WDIOF_SETTIMEOUT,
+	.identity = "OPEN-EYES sd151 Watchdog mux",
+};
+
+/****************************************************************************
+ * CLIENT HANDLING
+ ****************************************************************************/
+
+static void sd151_wdmux_keepalive(struct sd151_wdmux_client *client)
+{
+	client->deadline = jiffies + client->timeout * HZ;
+}
+
+static void sd151_wdmux_client_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct sd151_wdmux_client, ref));
+}
+
+/**
+ * @brief Lock the mux of a client
+ * @param [in] client client of an open file
+ * @return the locked mux, NULL when the device has been removed.
+ * @details Release it with sd151_wdmux_unlock().
+ */
+static struct sd151_wdmux *sd151_wdmux_lock(struct sd151_wdmux_client *client)
+{
+	struct sd151_wdmux *mux;
+
+	mutex_lock(&sd151_wdmux_detach);
+	if (!client->data) {
+		mutex_unlock(&sd151_wdmux_detach);
+		return NULL;
+	}
+
+	mux = &client->data->wdmux;
+	mutex_lock(&mux->lock);
+
+	return mux;
+}
+
+static void sd151_wdmux_unlock(struct sd151_wdmux *mux)
+{
+	mutex_unlock(&mux->lock);
+	mutex_unlock(&sd151_wdmux_detach);
+}
+
+/**
+ * @brief Check client deadlines and ping the hardware
+ * @param [in] work delayed work embedded into struct sd151_wdmux
+ * @details Runs every second while clients are registered. Once a client
+ * expired the hardware is no longer pinged, also from /dev/watchdog.
+ */
+static void sd151_wdmux_work(struct work_struct *work)
+{
+	struct sd151_wdmux *mux = container_of(to_delayed_work(work),
+		struct sd151_wdmux, work);
+	struct sd151_private *data = container_of(mux, struct sd151_private,
+		wdmux);
+	struct sd151_wdmux_client *client;
+	unsigned long interval;
+	bool expired = false;
+
+	mutex_lock(&mux->lock);
+
+	if (list_empty(&mux->clients)) {
+		WRITE_ONCE(mux->expired, false);
+		mutex_unlock(&mux->lock);
+		return;
+	}
+
+	list_for_each_entry(client, &mux->clients, list) {
+		if (!client->expired && time_after(jiffies, client->deadline)) {
+			client->expired = true;
+			mux->expirations++;
+			dev_crit(data->dev, "wdmux client '%s' missed its deadline\n",
+				client->name);
+		}
+		expired |= client->expired;
+	}
+
+	WRITE_ONCE(mux->expired, expired);
+
+	/* Ping at half the hardware timeout, as the watchdog core does */
+	interval = max(data->wdog_hw_timeout / 2, 1) * HZ;
+	if (!expired && time_after_eq(jiffies, mux->last_ping + interval)) {
+		if (sd151_wdog_hw_ping(data) == 0)
+			mux->last_ping = jiffies;
+	}
+
+	mutex_unlock(&mux->lock);
+
+	schedule_delayed_work(&mux->work, HZ);
+}
+
+/**
+ * @brief Unregister a client
+ * @param [in] mux struct sd151_wdmux pointer
+ * @param [in] client client to remove
+ * @details Called with mux->lock held. When the last client leaves the
+ * hardware watchdog is stopped again if the mux started it.
+ */
+static void sd151_wdmux_del(struct sd151_wdmux *mux,
+	struct sd151_wdmux_client *client)
+{
+	struct sd151_private *data = client->data;
+
+	list_del(&client->list);
+	mux->nclients--;
+	kref_put(&client->ref, sd151_wdmux_client_free);
+
+	if (!list_empty(&mux->clients) || !mux->started_hw)
+		return;
+
+	mux->started_hw = false;
+	if (!watchdog_active(&data->wdd) && !watchdog_hw_running(&data->wdd) &&
+	    !test_bit(WDOG_NO_WAY_OUT, &data->wdd.status))
+		sd151_bus_write(data, SD151_BUS_CRITICAL, SD151_COMMAND,
+			SD151_WDOG_DISABLE);
+}
+
+/****************************************************************************
+ * FILE OPERATIONS
+ ****************************************************************************/
+
+static int sd151_wdmux_open(struct inode *inode, struct file *filp)
+{
+	struct miscdevice *misc = filp->private_data;
+	struct sd151_wdmux *mux = container_of(misc, struct sd151_wdmux, misc);
+	struct sd151_private *data = container_of(mux, struct sd151_private,
+		wdmux);
+	struct sd151_wdmux_client *client;
+	unsigned int status;
+	bool first;
+	int ret;
+
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return -ENOMEM;
+
+	/* One reference for the file, one for the mux list */
+	kref_init(&client->ref);
+	kref_get(&client->ref);
+	client->data = data;
+	get_task_comm(client->name, current);
+	client->timeout = data->wdd.timeout;
+	sd151_wdmux_keepalive(client);
+
+	mutex_lock(&mux->lock);
+
+	first = list_empty(&mux->clients);
+	if (first && !watchdog_active(&data->wdd)) {
+		/*
+		 * First client: the hardware watchdog must run. Its state is read
+		 * from the MCU, it may have been stopped since probe.
+		 */
+		ret = sd151_bus_read(data, SD151_BUS_CRITICAL, SD151_STATUS,
+			&status);
+		if (ret >= 0 && !(status & SD151_STATUS_WDOG_EN)) {
+			ret = sd151_bus_write(data, SD151_BUS_CRITICAL, SD151_COMMAND,
+				SD151_WDOG_ENABLE);
+			if (ret >= 0)
+				mux->started_hw = true;
+		}
+		if (ret < 0) {
+			mutex_unlock(&mux->lock);
+			kfree(client);
+			return ret;
+		}
+	}
+
+	list_add_tail(&client->list, &mux->clients);
+	mux->nclients++;
+
+	if (first) {
+		mux->last_ping = jiffies - data->wdog_hw_timeout * HZ;
+		mod_delayed_work(system_wq, &mux->work, 0);
+	}
+
+	mutex_unlock(&mux->lock);
+
+	filp->private_data = client;
+
+	return stream_open(inode, filp);
+}
+
+static int sd151_wdmux_release(struct inode *inode, struct file *filp)
+{
+	struct sd151_wdmux_client *client = filp->private_data;
+	struct sd151_wdmux *mux = sd151_wdmux_lock(client);
+
+	if (mux) {
+		if (client->expect_close && !client->expired) {
+			sd151_wdmux_del(mux, client);
+		} else {
+			/* Left registered: its deadline will stop the hardware pings */
+			dev_crit(client->data->dev,
+				"wdmux client '%s' closed unexpectedly\n", client->name);
+		}
+		sd151_wdmux_unlock(mux);
+	}
+
+	kref_put(&client->ref, sd151_wdmux_client_free);
+
+	return 0;
+}
+
+static ssize_t sd151_wdmux_write(struct file *filp, const char __user *buf,
+	size_t len, loff_t *ppos)
+{
+	struct sd151_wdmux_client *client = filp->private_data;
+	struct sd151_wdmux *mux;
+	char cmd[SD151_WDMUX_CMD_LEN];
+	size_t n = min(len, sizeof(cmd) - 1);
+	size_t i;
+
+	if (!len)
+		return 0;
+
+	memset(cmd, 0, sizeof(cmd));
+	if (copy_from_user(cmd, buf, n))
+		return -EFAULT;
+
+	mux = sd151_wdmux_lock(client);
+	if (!mux)
+		return -ENODEV;
+
+	if (strncmp(cmd, "name=", 5) == 0) {
+		strim(cmd);
+		strscpy(client->name, cmd + 5, sizeof(client->name));
+	} else {
+		/* Magic close, as in the watchdog core */
+		client->expect_close = false;
+		for (i = 0; i < n; i++) {
+			if (cmd[i] == 'V')
+				client->expect_close = true;
+		}
+	}
+
+	if (!client->expired)
+		sd151_wdmux_keepalive(client);
+
+	sd151_wdmux_unlock(mux);
+
+	return len;
+}
+
+static long sd151_wdmux_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
+{
+	struct sd151_wdmux_client *client = filp->private_data;
+	struct sd151_wdmux *mux;
+	void __user *argp = (void __user *)arg;
+	int __user *p = argp;
+	unsigned int val;
+	int ret = 0;
+
+	switch (cmd) {
+		case WDIOC_GETSUPPORT:
+			return copy_to_user(argp, &sd151_wdmux_info,
+				sizeof(sd151_wdmux_info)) ? -EFAULT : 0;
+		case WDIOC_GETSTATUS:
+		case WDIOC_GETBOOTSTATUS:
+			return put_user(0, p);
+		default:
+			break;
+	}
+
+	mux = sd151_wdmux_lock(client);
+	if (!mux)
+		return -ENODEV;
+
+	switch (cmd) {
+		case WDIOC_KEEPALIVE:
+			if (client->expired)
+				ret = -ETIMEDOUT;
+			else
+				sd151_wdmux_keepalive(client);
+			break;
+		case WDIOC_SETTIMEOUT:
+			if (get_user(val, p)) {
+				ret = -EFAULT;
+				break;
+			}
+			if (!val || val > UINT_MAX / HZ) {
+				ret = -EINVAL;
+				break;
+			}
+			client->timeout = val;
+			if (!client->expired)
+				sd151_wdmux_keepalive(client);
+			fallthrough;
+		case WDIOC_GETTIMEOUT:
+			ret = put_user(client->timeout, p);
+			break;
+		case WDIOC_GETTIMELEFT:
+			if (client->expired || time_after(jiffies, client->deadline))
+				val = 0;
+			else
+				val = jiffies_to_msecs(client->deadline - jiffies) / 1000;
+			ret = put_user(val, p);
+			break;
+		default:
+			ret = -ENOTTY;
+			break;
+	}
+
+	sd151_wdmux_unlock(mux);
+
+	return ret;
+}
+
+static const struct file_operations sd151_wdmux_fops = {
+	.owner          = THIS_MODULE,
+	.llseek         = no_llseek,
+	.open           = sd151_wdmux_open,
+	.release        = sd151_wdmux_release,
+	.write          = sd151_wdmux_write,
+	.unlocked_ioctl = sd151_wdmux_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+};
+
+/****************************************************************************
+ * WATCHDOG MUX INITIALIZATION
+ ****************************************************************************/
+
+int sd151_wdmux_init(struct sd151_private *data)
+{
+	struct sd151_wdmux *mux = &data->wdmux;
+	int ret;
+
+	mutex_init(&mux->lock);
+	INIT_LIST_HEAD(&mux->clients);
+	INIT_DELAYED_WORK(&mux->work, sd151_wdmux_work);
+
+	mux->misc.minor = MISC_DYNAMIC_MINOR;
+	mux->misc.name = "sd151_wdmux";
+	mux->misc.fops = &sd151_wdmux_fops;
+	mux->misc.parent = data->dev;
+
+	ret = misc_register(&mux->misc);
+	if (ret) {
+		dev_err(data->dev, "failed to register watchdog mux\n");
+		return ret;
+	}
+
+	mux->registered = true;
+
+	return 0;
+}
+
+EXPORT_SYMBOL_GPL(sd151_wdmux_init);
+
+int sd151_wdmux_remove(struct sd151_private *data)
+{
+	struct sd151_wdmux *mux = &data->wdmux;
+	struct sd151_wdmux_client *client, *tmp;
+
+	if (!mux->registered)
+		return 0;
+
+	/* No new file after this, the open ones may outlive the device */
+	misc_deregister(&mux->misc);
+
+	mutex_lock(&sd151_wdmux_detach);
+	mutex_lock(&mux->lock);
+
+	/* Orphans are freed here, clients with a file on their release */
+	list_for_each_entry_safe(client, tmp, &mux->clients, list) {
+		list_del(&client->list);
+		client->data = NULL;
+		kref_put(&client->ref, sd151_wdmux_client_free);
+	}
+	mux->nclients = 0;
+	mux->registered = false;
+
+	mutex_unlock(&mux->lock);
+	mutex_unlock(&sd151_wdmux_detach);
+
+	cancel_delayed_work_sync(&mux->work);
+
+	return 0;
+}
+
+EXPORT_SYMBOL_GPL(sd151_wdmux_remove);
@@ -29,24 +29,100 @@
 
 #include "sd151.h"
 
+extern int sd151_wdmux_init(struct sd151_private *);
+extern int sd151_wdmux_remove(struct sd151_private *);
+extern int sd151_bus_read(struct sd151_private *, int, unsigned int,
+	unsigned int *);
+extern int sd151_bus_write(struct sd151_private *, int, unsigned int,
+	unsigned int);
+
+/****************************************************************************
+ * WATCHDOG PRETIMEOUT
+ ****************************************************************************/
+
+/*
+ * The firmware has no pretimeout of its own: the pretimeout is timed on the
+ * host and re-armed on every successful hardware ping, so it expires
+ * pretimeout seconds before the MCU hard reset if the pings stop.
+ * When the watchdog core drives a timeout longer than the hardware one, its
+ * last ping lands one hardware timeout before the logical expiry, so timing
+ * against the hardware timeout stays correct.
+ */
+static void sd151_wdt_pretimeout_arm(struct sd151_private *data)
+{
+	struct watchdog_device *wdd = &data->wdd;
+
+	if (!wdd->pretimeout || wdd->pretimeout >= data->wdog_hw_timeout) {
+		hrtimer_cancel(&data->pretimeout_timer);
+		return;
+	}
+
+	hrtimer_start(&data->pretimeout_timer,
+		ktime_set(data->wdog_hw_timeout - wdd->pretimeout, 0),
+		HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart sd151_wdt_pretimeout_expired(struct hrtimer *timer)
+{
+	struct sd151_private *data = container_of(timer, struct sd151_private,
+		pretimeout_timer);
+
+	/* The I2C buzzer command cannot be sent from hrtimer context */
+	if (data->overlay_wdog_pretimeout_beep)
+		schedule_work(&data->pretimeout_work);
+
+	watchdog_notify_pretimeout(&data->wdd);
+
+	return HRTIMER_NORESTART;
+}
+
+static void sd151_wdt_pretimeout_work(struct work_struct *work)
+{
+	struct sd151_private *data = container_of(work, struct sd151_private,
+		pretimeout_work);
+	int ret = sd151_bus_write(data, SD151_BUS_INTERACTIVE, SD151_COMMAND,
+		SD151_BUZZER_HIGH);
+
+	if (ret < 0)
+		dev_err(data->dev, "failed to raise buzzer on watchdog pretimeout\n");
+}
 
 /****************************************************************************
  * WATCHDOG OPS
  ****************************************************************************/
 
-static int sd151_wdt_ping(struct watchdog_device *wdd)
+int sd151_wdog_hw_ping(struct sd151_private *data)
 {
-	struct sd151_private *data = watchdog_get_drvdata(wdd);
-	int ret = regmap_write(data->regmap, SD151_WDOG_REFRESH,
+	int ret = sd151_bus_write(data, SD151_BUS_CRITICAL, SD151_WDOG_REFRESH,
 		SD151_WDOG_REFRESH_MAGIC_VALUE);
 
+	if (!ret)
+		sd151_wdt_pretimeout_arm(data);
+
 	return ret;
 }
 
+EXPORT_SYMBOL_GPL(sd151_wdog_hw_ping);
+
+static int sd151_wdt_ping(struct watchdog_device *wdd)
+{
+	struct sd151_private *data = watchdog_get_drvdata(wdd);
+
+	/* An expired watchdog mux client holds back every hardware ping */
+	if (READ_ONCE(data->wdmux.expired))
+		return 0;
+
+	return sd151_wdog_hw_ping(data);
+}
+
 static int sd151_wdt_start(struct watchdog_device *wdd)
 {
 	struct sd151_private *data = watchdog_get_drvdata(wdd);
-	int ret = regmap_write(data->regmap, SD151_COMMAND,	SD151_WDOG_ENABLE);
+	int ret = sd151_bus_write(data, SD151_BUS_CRITICAL, SD151_COMMAND,
+		SD151_WDOG_ENABLE);
+
+	if (!ret)
+		sd151_wdt_pretimeout_arm(data);
 
 	return ret;
 }
@@ -54,29 +130,66 @@ static int sd151_wdt_start(struct watchdog_device *wdd)
 static int sd151_wdt_stop(struct watchdog_device *wdd)
 {
 	struct sd151_private *data = watchdog_get_drvdata(wdd);
-	int	ret = regmap_write(data->regmap, SD151_COMMAND,	SD151_WDOG_DISABLE);
+	int ret = sd151_bus_write(data, SD151_BUS_CRITICAL, SD151_COMMAND,
+		SD151_WDOG_DISABLE);
+
+	hrtimer_cancel(&data->pretimeout_timer);
 
 	return ret;
 }
 
+/*
+ * Timeouts above SD151_WDOG_MAX_HW_TIMEOUT are handled by the watchdog core:
+ * the hardware is programmed with its maximum and the core keeps pinging it
+ * (max_hw_heartbeat_ms) until the logical timeout expires.
+ */
 static int sd151_wdt_settimeout(struct watchdog_device *wdd, unsigned int to)
 {
 	struct sd151_private *data = watchdog_get_drvdata(wdd);
 	int ret;
 	unsigned int reg;
+	unsigned int hw_to;
 
-	if ((watchdog_timeout_invalid(wdd, to))||(to>255)) {
+	if (watchdog_timeout_invalid(wdd, to)) {
 		return -EINVAL;
 	}
 
+	hw_to = min_t(unsigned int, to, SD151_WDOG_MAX_HW_TIMEOUT);
+
 	/* build up register value */
 	reg = ((data->wdog_wait/5)<<SD151_WDOG_WAIT_POS)&SD151_WDOG_WAIT_MASK;
-	reg |= (to&SD151_WDOG_TIMEOUT_MASK)<<SD151_WDOG_TIMEOUT_POS;
+	reg |= (hw_to&SD151_WDOG_TIMEOUT_MASK)<<SD151_WDOG_TIMEOUT_POS;
 
-	ret = regmap_write(data->regmap, SD151_WDOG_TIMEOUT,reg);
+	ret = sd151_bus_write(data, SD151_BUS_CRITICAL, SD151_WDOG_TIMEOUT, reg);
+	if (ret < 0)
+		return ret;
 
+	data->wdog_hw_timeout = hw_to;
 	wdd->timeout = to;
 
+	/* A pretimeout must stay shorter than the hardware timeout */
+	if (wdd->pretimeout >= hw_to)
+		wdd->pretimeout = 0;
+
+	if (watchdog_active(wdd))
+		sd151_wdt_pretimeout_arm(data);
+
+	return 0;
+}
+
+static int sd151_wdt_setpretimeout(struct watchdog_device *wdd,
+	unsigned int pretimeout)
+{
+	struct sd151_private *data = watchdog_get_drvdata(wdd);
+
+	if (pretimeout >= data->wdog_hw_timeout)
+		return -EINVAL;
+
+	wdd->pretimeout = pretimeout;
+
+	if (watchdog_active(wdd))
+		sd151_wdt_pretimeout_arm(data);
+
 	return 0;
 }
 
@@ -90,10 +203,12 @@ static const struct watchdog_ops sd151_wdt_ops = {
 	.stop = sd151_wdt_stop,
 	.ping = sd151_wdt_ping,
 	.set_timeout	= sd151_wdt_settimeout,
+	.set_pretimeout	= sd151_wdt_setpretimeout,
 };
 
 static struct watchdog_info sd151_wdt_info = {
-	.options = WDIOF_KEEPALIVEPING | WDIOF_MAGICCLOSE | WDIOF_SETTIMEOUT,
+	.options = WDIOF_KEEPALIVEPING | WDIOF_MAGICCLOSE | WDIOF_SETTIMEOUT |
+	           WDIOF_PRETIMEOUT,
 	.identity = "OPEN-EYES sd151 Watchdog",
 };
 
@@ -107,12 +222,17 @@ int sd151_wdog_init(struct sd151_private *data)
 	//struct sd151_private *data = dev_get_drvdata(dev);
 	int ret;
 	int tinfo;
+	unsigned int to;
 	bool update_device=false;
 
 	watchdog_set_drvdata(&data->wdd, data);
 
+	hrtimer_init(&data->pretimeout_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	data->pretimeout_timer.function = sd151_wdt_pretimeout_expired;
+	INIT_WORK(&data->pretimeout_work, sd151_wdt_pretimeout_work);
+
 	/* get timeout info from device */
-	ret = regmap_read(data->regmap, SD151_WDOG_TIMEOUT, &tinfo);
+	ret = sd151_bus_read(data, SD151_BUS_CRITICAL, SD151_WDOG_TIMEOUT, &tinfo);
 	if (ret < 0) {
 		dev_err(data->dev, "failed to read I2C when init watchdog\n");
 		return ret;
@@ -126,6 +246,7 @@ int sd151_wdog_init(struct sd151_private *data)
 	if (data->overlay_wdog_timeout==-1) {
 		/* If not defined in overlay get timeout value from device */
 		data->wdd.timeout = data->device_wdog_timeout;
+		data->wdog_hw_timeout = data->device_wdog_timeout;
 	} else {
 		/* else overlay have priority */
 		data->wdd.timeout = data->overlay_wdog_timeout;
@@ -147,16 +268,92 @@ int sd151_wdog_init(struct sd151_private *data)
 	data->wdd.info = &sd151_wdt_info;
 	data->wdd.ops = &sd151_wdt_ops;
 
+	/*
+	 * Let the watchdog core ping the hardware for timeouts longer than the
+	 * 8 bit hardware field, and coalesce keepalives closer than the minimum
+	 * heartbeat into a single I2C write.
+	 */
+	data->wdd.max_hw_heartbeat_ms = SD151_WDOG_MAX_HW_TIMEOUT * 1000;
+	if (data->overlay_wdog_min_heartbeat < 0)
+		data->wdd.min_hw_heartbeat_ms = SD151_DEF_WDOG_MIN_HEARTBEAT;
+	else
+		data->wdd.min_hw_heartbeat_ms = data->overlay_wdog_min_heartbeat;
+
+	/* A deferred keepalive must still land before the timeout */
+	data->wdd.min_timeout = max_t(unsigned int, SD151_MIN_WDOG_TIMEOUT,
+		DIV_ROUND_UP(data->wdd.min_hw_heartbeat_ms, 1000) + 1);
+
 	watchdog_set_nowayout(&data->wdd, data->overlay_wdog_nowayout);
 
-	if (update_device)
-		sd151_wdt_settimeout(&data->wdd,data->wdd.timeout);
+	/* set_timeout rejects values out of range: clamp overlay or device */
+	to = clamp_t(unsigned int, data->wdd.timeout, data->wdd.min_timeout,
+		SD151_MAX_WDOG_TIMEOUT);
+	if (to != data->wdd.timeout) {
+		dev_warn(data->dev, "watchdog timeout %u s out of range, using %u s\n",
+			data->wdd.timeout, to);
+		data->wdd.timeout = to;
+		update_device = true;
+	}
+
+	if (update_device) {
+		ret = sd151_wdt_settimeout(&data->wdd, data->wdd.timeout);
+		if (ret < 0) {
+			dev_err(data->dev, "failed to set watchdog timeout\n");
+			return ret;
+		}
+	}
+
+	/* Pretimeout from overlay, ignored when not below the timeout */
+	if (data->overlay_wdog_pretimeout > 0 &&
+	    data->overlay_wdog_pretimeout < data->wdog_hw_timeout)
+		data->wdd.pretimeout = data->overlay_wdog_pretimeout;
+
+	/* Start at boot if requested by the overlay */
+	if (data->overlay_wdog_boot_enabled &&
+	    !(data->boot_status & SD151_STATUS_WDOG_EN)) {
+		ret = sd151_wdt_start(&data->wdd);
+		if (ret < 0)
+			dev_err(data->dev, "failed to start watchdog at boot\n");
+		else
+			data->boot_status |= SD151_STATUS_WDOG_EN;
+	}
+
+	/*
+	 * Watchdog already running: the core pings it until userspace opens
+	 * the device (watchdog.handle_boot_enabled)
+	 */
+	if (data->boot_status & SD151_STATUS_WDOG_EN)
+		set_bit(WDOG_HW_RUNNING, &data->wdd.status);
 
 	ret = watchdog_register_device(&data->wdd);
 	if (ret)
 		return ret;
 
+	if (data->overlay_wdog_mux) {
+		ret = sd151_wdmux_init(data);
+		if (ret) {
+			watchdog_unregister_device(&data->wdd);
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
 EXPORT_SYMBOL_GPL(sd151_wdog_init);
+
+int sd151_wdog_remove(struct sd151_private *data)
+{
+	/* Watchdog not initialized */
+	if (!data->wdd.ops)
+		return 0;
+
+	sd151_wdmux_remove(data);
+	watchdog_unregister_device(&data->wdd);
+	hrtimer_cancel(&data->pretimeout_timer);
+	cancel_work_sync(&data->pretimeout_work);
+
+	return 0;
+}
+
+EXPORT_SYMBOL_GPL(sd151_wdog_remove);
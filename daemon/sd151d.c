@@ -0,0 +1,677 @@
+/*
+ * sd151d.c - Part of OPEN-EYES PI-POW HAT product
+ *
+ * SD151 telemetry snapshot daemon. The driver interfaces (hwmon, RTC and
+ * /proc/sd151) are sampled once per interval; the snapshot is published in
+ * shared memory (see sd151d.h) and served on a Unix socket:
+ *
+ *   socat - UNIX-CONNECT:/run/sd151d.sock            Prometheus text format
+ *   echo json | socat - UNIX-CONNECT:/run/sd151d.sock    JSON
+ *   curl --unix-socket /run/sd151d.sock http://x/metrics  (or /json)
+ *
+ * With -o the Prometheus text is also written to a file for the
+ * node_exporter textfile collector. Any number of consumers costs one bus
+ * sample per interval.
+ *
+ * This file is part of sd151-hwmon distribution
+ * https://github.com/openeyes-lab/sd151-hwmon
+ *
+ * Copyright (c) 2021 OPEN-EYES Srl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "sd151d.h"
+
+#define DEFAULT_INTERVAL_MS     1000
+#define CLIENT_TIMEOUT_MS       100
+#define OUT_SIZE                32768
+#define PROC_MAX_NUMBERS        8
+
+static const char sopts[] = "i:s:m:o:fh";
+static const struct option lopts[] = {
+	{"interval",      required_argument, NULL, 'i'},
+	{"socket",        required_argument, NULL, 's'},
+	{"shm",           required_argument, NULL, 'm'},
+	{"textfile",      required_argument, NULL, 'o'},
+	{"foreground",          no_argument, NULL, 'f'},
+	{"help",                no_argument, NULL, 'h'},
+	{NULL,                  no_argument, NULL, 0x0}
+};
+
+struct out {
+	char buf[OUT_SIZE];
+	size_t len;
+};
+
+static volatile sig_atomic_t stop;
+static struct sd151d_snapshot snap;
+static struct sd151d_snapshot *shm;
+static char hwmon[300];
+
+static void term(int sig)
+{
+	stop = 1;
+}
+
+static unsigned long long now_us(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void oprintf(struct out *o, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (o->len >= sizeof(o->buf))
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(o->buf + o->len, sizeof(o->buf) - o->len, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		o->len += n;
+	if (o->len > sizeof(o->buf))
+		o->len = sizeof(o->buf);
+}
+
+/* Print a string escaped for Prometheus label values and JSON strings */
+static void oescape(struct out *o, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			oprintf(o, "\\%c", *s);
+		else if ((unsigned char)*s >= ' ')
+			oprintf(o, "%c", *s);
+	}
+}
+
+/****************************************************************************
+ * SAMPLING
+ ****************************************************************************/
+
+static int read_text(const char *path, char *buf, size_t size)
+{
+	int f = open(path, O_RDONLY);
+	int n;
+
+	if (f < 0)
+		return -1;
+	n = read(f, buf, size - 1);
+	close(f);
+	if (n < 0)
+		return -1;
+	buf[n] = 0;
+	while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == ' '))
+		buf[--n] = 0;
+	return n;
+}
+
+static int read_long(const char *path, long long *val)
+{
+	char buf[32];
+
+	if (read_text(path, buf, sizeof(buf)) <= 0)
+		return -1;
+	*val = strtoll(buf, NULL, 0);
+	return 0;
+}
+
+static int find_hwmon(void)
+{
+	char path[512];
+	char name[64];
+	struct dirent *de;
+	DIR *d;
+
+	hwmon[0] = 0;
+	d = opendir("/sys/class/hwmon");
+	while (d && (de = readdir(d))) {
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s/name", de->d_name);
+		if (read_text(path, name, sizeof(name)) > 0 &&
+		    !strncmp(name, "sd151", 5)) {
+			snprintf(hwmon, sizeof(hwmon), "/sys/class/hwmon/%s", de->d_name);
+			break;
+		}
+	}
+	if (d)
+		closedir(d);
+
+	return hwmon[0] ? 0 : -1;
+}
+
+static char *trim(char *s)
+{
+	char *e;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+	e = s + strlen(s);
+	while (e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\n'))
+		*--e = 0;
+	return s;
+}
+
+/* Keep the "key : value" lines of the /proc report */
+static int sample_proc(void)
+{
+	char buf[4096];
+	char *line, *save, *sep;
+	struct sd151d_field *f;
+
+	snap.nfields = 0;
+	if (read_text("/proc/sd151", buf, sizeof(buf)) < 0)
+		return -1;
+
+	for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		sep = strchr(line, ':');
+		if (!sep || snap.nfields >= SD151D_MAX_FIELDS)
+			continue;
+		*sep = 0;
+		f = &snap.field[snap.nfields++];
+		snprintf(f->key, sizeof(f->key), "%s", trim(line));
+		snprintf(f->value, sizeof(f->value), "%s", trim(sep + 1));
+	}
+
+	return 0;
+}
+
+static int sample(void)
+{
+	char path[512];
+	char rtc[800];
+	struct dirent *de;
+	long long val = 0;
+	unsigned long long t0 = now_us(CLOCK_MONOTONIC);
+	int ret = 0;
+	int i;
+	DIR *d;
+
+	if (!hwmon[0] && find_hwmon())
+		return -1;
+
+	for (i = 0; i < SD151D_CHANNELS; i++) {
+		snprintf(path, sizeof(path), "%s/in%d_label", hwmon, i);
+		read_text(path, snap.in[i].label, sizeof(snap.in[i].label));
+		snprintf(path, sizeof(path), "%s/in%d_input", hwmon, i);
+		ret |= read_long(path, &val);
+		snap.in[i].input_mv = val;
+		snprintf(path, sizeof(path), "%s/in%d_min", hwmon, i);
+		ret |= read_long(path, &val);
+		snap.in[i].min_mv = val;
+		snprintf(path, sizeof(path), "%s/in%d_max", hwmon, i);
+		ret |= read_long(path, &val);
+		snap.in[i].max_mv = val;
+	}
+
+	/* A failing hwmon read means the driver went away, look it up again */
+	if (ret)
+		hwmon[0] = 0;
+
+	snap.rtc_time = -1;
+	snprintf(path, sizeof(path), "%s/device/rtc", hwmon);
+	d = opendir(path);
+	while (d && (de = readdir(d))) {
+		if (strncmp(de->d_name, "rtc", 3))
+			continue;
+		snprintf(rtc, sizeof(rtc), "%s/%s/since_epoch", path, de->d_name);
+		if (!read_long(rtc, &val))
+			snap.rtc_time = val;
+		break;
+	}
+	if (d)
+		closedir(d);
+
+	ret |= sample_proc();
+
+	snap.sample_us = now_us(CLOCK_MONOTONIC) - t0;
+
+	return ret;
+}
+
+/* Copy the snapshot to shared memory under the sequence counter */
+static void publish(void)
+{
+	uint32_t seq;
+
+	if (!shm)
+		return;
+
+	seq = shm->seq | 1;
+	shm->seq = seq;
+	__sync_synchronize();
+	snap.seq = seq;
+	memcpy(shm, &snap, sizeof(snap));
+	__sync_synchronize();
+	shm->seq = seq + 1;
+}
+
+/****************************************************************************
+ * OUTPUT FORMATS
+ ****************************************************************************/
+
+/*
+ * Split a /proc value into its numbers and its text, each number replaced by
+ * "N" in the text. Only standalone numbers count: "sd151-hwmon" is text.
+ */
+static int proc_numbers(const char *value, long long *num, char *text,
+	size_t size)
+{
+	const char *s = value;
+	const char *d;
+	char *end;
+	size_t len = 0;
+	int n = 0;
+
+	while (*s && len + 2 < size) {
+		d = (*s == '-') ? s + 1 : s;
+		if (isdigit((unsigned char)*d) && (s == value ||
+		    (!isalnum((unsigned char)s[-1]) && s[-1] != '-'))) {
+			long long v = strtoll(s, &end, 10);
+
+			if (!isalnum((unsigned char)*end)) {
+				if (n < PROC_MAX_NUMBERS)
+					num[n++] = v;
+				text[len++] = 'N';
+				s = end;
+				continue;
+			}
+		}
+		text[len++] = *s++;
+	}
+	text[len] = 0;
+
+	return n;
+}
+
+/* Keys may repeat (one "wake" line per request): label them by occurrence */
+static void proc_labels(struct out *o, unsigned int i)
+{
+	unsigned int j, line = 0, count = 0;
+
+	for (j = 0; j < snap.nfields; j++) {
+		if (strcmp(snap.field[j].key, snap.field[i].key))
+			continue;
+		if (j < i)
+			line++;
+		count++;
+	}
+
+	oprintf(o, "key=\"");
+	oescape(o, snap.field[i].key);
+	oprintf(o, "\"");
+	if (count > 1)
+		oprintf(o, ",line=\"%u\"", line);
+}
+
+static void format_prometheus(struct out *o)
+{
+	static const char *const names[] = { "input", "min", "max" };
+	long long num[PROC_MAX_NUMBERS];
+	char text[SD151D_VALUE_LEN];
+	int32_t v;
+	unsigned int i, j;
+	int n;
+
+	oprintf(o, "# HELP sd151_up Last sample of the SD151 succeeded.\n");
+	oprintf(o, "# TYPE sd151_up gauge\nsd151_up %u\n", snap.up);
+	oprintf(o, "# HELP sd151_samples_total Samples taken by sd151d.\n");
+	oprintf(o, "# TYPE sd151_samples_total counter\nsd151_samples_total %llu\n",
+		(unsigned long long)snap.samples);
+	oprintf(o, "# HELP sd151_sample_errors_total Samples with a failed read.\n");
+	oprintf(o, "# TYPE sd151_sample_errors_total counter\n");
+	oprintf(o, "sd151_sample_errors_total %llu\n", (unsigned long long)snap.errors);
+	oprintf(o, "# HELP sd151_sample_duration_seconds Duration of the last sample.\n");
+	oprintf(o, "# TYPE sd151_sample_duration_seconds gauge\n");
+	oprintf(o, "sd151_sample_duration_seconds %.6f\n", snap.sample_us / 1e6);
+	oprintf(o, "# HELP sd151_sample_timestamp_seconds Time of the last sample.\n");
+	oprintf(o, "# TYPE sd151_sample_timestamp_seconds gauge\n");
+	oprintf(o, "sd151_sample_timestamp_seconds %.3f\n", snap.timestamp_ms / 1e3);
+
+	for (j = 0; j < 3; j++) {
+		oprintf(o, "# HELP sd151_voltage_%s_volts Rail voltage %s.\n",
+			names[j], names[j]);
+		oprintf(o, "# TYPE sd151_voltage_%s_volts gauge\n", names[j]);
+		for (i = 0; i < SD151D_CHANNELS; i++) {
+			v = j == 0 ? snap.in[i].input_mv :
+			    j == 1 ? snap.in[i].min_mv : snap.in[i].max_mv;
+			oprintf(o, "sd151_voltage_%s_volts{channel=\"%u\",label=\"",
+				names[j], i);
+			oescape(o, snap.in[i].label);
+			oprintf(o, "\"} %.3f\n", v / 1e3);
+		}
+	}
+
+	if (snap.rtc_time >= 0) {
+		oprintf(o, "# HELP sd151_rtc_time_seconds SD151 RTC time.\n");
+		oprintf(o, "# TYPE sd151_rtc_time_seconds gauge\n");
+		oprintf(o, "sd151_rtc_time_seconds %lld\n", (long long)snap.rtc_time);
+	}
+
+	/*
+	 * Counters of the report change on every scrape: they are samples, only
+	 * the text with the numbers masked is a label, so series stay bounded.
+	 */
+	oprintf(o, "# HELP sd151_proc_value Numbers of the /proc/sd151 report, "
+		"by position in the line.\n");
+	oprintf(o, "# TYPE sd151_proc_value gauge\n");
+	for (i = 0; i < snap.nfields; i++) {
+		n = proc_numbers(snap.field[i].value, num, text, sizeof(text));
+		for (j = 0; j < (unsigned int)n; j++) {
+			oprintf(o, "sd151_proc_value{");
+			proc_labels(o, i);
+			oprintf(o, ",index=\"%u\"} %lld\n", j, num[j]);
+		}
+	}
+
+	oprintf(o, "# HELP sd151_info Text of the /proc/sd151 report, numbers "
+		"as N.\n");
+	oprintf(o, "# TYPE sd151_info gauge\n");
+	for (i = 0; i < snap.nfields; i++) {
+		proc_numbers(snap.field[i].value, num, text, sizeof(text));
+		oprintf(o, "sd151_info{");
+		proc_labels(o, i);
+		oprintf(o, ",value=\"");
+		oescape(o, text);
+		oprintf(o, "\"} 1\n");
+	}
+}
+
+static void format_json(struct out *o)
+{
+	unsigned int i;
+
+	oprintf(o, "{\"up\":%u,\"timestamp_ms\":%llu,\"interval_ms\":%llu,"
+		"\"samples\":%llu,\"errors\":%llu,\"sample_us\":%llu,",
+		snap.up, (unsigned long long)snap.timestamp_ms,
+		(unsigned long long)snap.interval_ms,
+		(unsigned long long)snap.samples, (unsigned long long)snap.errors,
+		(unsigned long long)snap.sample_us);
+	if (snap.rtc_time >= 0)
+		oprintf(o, "\"rtc_time\":%lld,", (long long)snap.rtc_time);
+	else
+		oprintf(o, "\"rtc_time\":null,");
+
+	oprintf(o, "\"voltages\":[");
+	for (i = 0; i < SD151D_CHANNELS; i++) {
+		oprintf(o, "%s{\"channel\":%u,\"label\":\"", i ? "," : "", i);
+		oescape(o, snap.in[i].label);
+		oprintf(o, "\",\"input_mv\":%d,\"min_mv\":%d,\"max_mv\":%d}",
+			snap.in[i].input_mv, snap.in[i].min_mv, snap.in[i].max_mv);
+	}
+
+	/* Keys may repeat (one "wake" line per request): a list of pairs */
+	oprintf(o, "],\"proc\":[");
+	for (i = 0; i < snap.nfields; i++) {
+		oprintf(o, "%s[\"", i ? "," : "");
+		oescape(o, snap.field[i].key);
+		oprintf(o, "\",\"");
+		oescape(o, snap.field[i].value);
+		oprintf(o, "\"]");
+	}
+	oprintf(o, "]}\n");
+}
+
+static void write_textfile(const char *path)
+{
+	static struct out o;
+	char tmp[512];
+	int f;
+
+	o.len = 0;
+	format_prometheus(&o);
+
+	/* The collector must never see a partial file */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f < 0)
+		return;
+	if (write(f, o.buf, o.len) != (ssize_t)o.len) {
+		close(f);
+		unlink(tmp);
+		return;
+	}
+	close(f);
+	rename(tmp, path);
+}
+
+/****************************************************************************
+ * SOCKET
+ ****************************************************************************/
+
+static void serve(int lfd)
+{
+	static struct out o;
+	struct timeval tv = { 0, CLIENT_TIMEOUT_MS * 1000 };
+	struct pollfd p;
+	char req[256] = "";
+	int json = 0, http = 0;
+	int cfd, n;
+	size_t off;
+
+	cfd = accept(lfd, NULL, NULL);
+	if (cfd < 0)
+		return;
+	setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* A request is optional: a silent client gets the Prometheus text */
+	p.fd = cfd;
+	p.events = POLLIN;
+	if (poll(&p, 1, CLIENT_TIMEOUT_MS) > 0) {
+		n = read(cfd, req, sizeof(req) - 1);
+		if (n > 0)
+			req[n] = 0;
+	}
+
+	if (!strncmp(req, "GET ", 4)) {
+		http = 1;
+		json = !strncmp(req + 4, "/json", 5);
+	} else {
+		json = !strncmp(req, "json", 4);
+	}
+
+	o.len = 0;
+	if (json)
+		format_json(&o);
+	else
+		format_prometheus(&o);
+
+	if (http) {
+		dprintf(cfd, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n"
+			"Content-Length: %zu\r\n\r\n",
+			json ? "application/json" : "text/plain; version=0.0.4",
+			o.len);
+	}
+
+	for (off = 0; off < o.len; off += n) {
+		n = write(cfd, o.buf + off, o.len - off);
+		if (n <= 0)
+			break;
+	}
+
+	close(cfd);
+}
+
+static int socket_open(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chmod(path, 0666) || listen(fd, 16)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static struct sd151d_snapshot *shm_open_snapshot(const char *name)
+{
+	struct sd151d_snapshot *p;
+	int fd;
+
+	fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, sizeof(*p))) {
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, sizeof(*p), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static void usage(char *progname)
+{
+	printf("Usage: %s [options]\n", progname);
+	printf(" -i, --interval=MS\tSample interval in ms (default %d)\n",
+	       DEFAULT_INTERVAL_MS);
+	printf(" -s, --socket=PATH\tUnix socket (default %s)\n", SD151D_SOCKET);
+	printf(" -m, --shm=NAME\t\tShared memory snapshot (default %s)\n",
+	       SD151D_SHM_NAME);
+	printf(" -o, --textfile=PATH\tAlso write Prometheus text to PATH\n");
+	printf(" -f, --foreground\tDo not daemonize\n");
+	printf(" -h, --help\t\tPrint the help message\n");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long interval = DEFAULT_INTERVAL_MS;
+	char *sock = SD151D_SOCKET;
+	char *shm_name = SD151D_SHM_NAME;
+	char *textfile = NULL;
+	int foreground = 0;
+	struct itimerspec its;
+	struct pollfd p[2];
+	uint64_t ticks;
+	int lfd, tfd, c;
+
+	while ((c = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+		switch (c) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			if (!interval)
+				interval = DEFAULT_INTERVAL_MS;
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		case 'm':
+			shm_name = optarg;
+			break;
+		case 'o':
+			textfile = optarg;
+			break;
+		case 'f':
+			foreground = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+
+	signal(SIGINT, term);
+	signal(SIGTERM, term);
+	signal(SIGPIPE, SIG_IGN);
+
+	shm = shm_open_snapshot(shm_name);
+	if (!shm)
+		fprintf(stderr, "shared memory %s: %s\n", shm_name, strerror(errno));
+
+	lfd = socket_open(sock);
+	if (lfd < 0) {
+		fprintf(stderr, "socket %s: %s\n", sock, strerror(errno));
+		return 1;
+	}
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_nsec = 1;
+	its.it_interval.tv_sec = interval / 1000;
+	its.it_interval.tv_nsec = (interval % 1000) * 1000000;
+	if (tfd < 0 || timerfd_settime(tfd, 0, &its, NULL)) {
+		fprintf(stderr, "timer: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (!foreground && daemon(0, 0)) {
+		fprintf(stderr, "daemon: %s\n", strerror(errno));
+		return 1;
+	}
+
+	snap.magic = SD151D_MAGIC;
+	snap.version = SD151D_VERSION;
+	snap.interval_ms = interval;
+	snap.rtc_time = -1;
+
+	p[0].fd = tfd;
+	p[0].events = POLLIN;
+	p[1].fd = lfd;
+	p[1].events = POLLIN;
+
+	while (!stop) {
+		if (poll(p, 2, -1) < 0)
+			continue;
+
+		if (p[0].revents & POLLIN) {
+			if (read(tfd, &ticks, sizeof(ticks)) < 0)
+				continue;
+			snap.samples++;
+			snap.up = !sample();
+			if (!snap.up)
+				snap.errors++;
+			snap.timestamp_ms = now_us(CLOCK_REALTIME) / 1000;
+			publish();
+			if (textfile)
+				write_textfile(textfile);
+		}
+
+		if (p[1].revents & POLLIN)
+			serve(lfd);
+	}
+
+	close(lfd);
+	unlink(sock);
+	if (shm)
+		shm_unlink(shm_name);
+
+	return 0;
+}
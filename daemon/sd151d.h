@@ -0,0 +1,86 @@
+/*
+ * sd151d.h - Part of OPEN-EYES PI-POW HAT product
+ *
+ * Layout of the shared memory snapshot published by sd151d. Consumers map
+ * SD151D_SHM_NAME read only and copy the snapshot with sd151d_snapshot_read,
+ * which retries while the daemon is updating it.
+ *
+ * This file is part of sd151-hwmon distribution
+ * https://github.com/openeyes-lab/sd151-hwmon
+ *
+ * Copyright (c) 2021 OPEN-EYES Srl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _SD151D_H
+#define _SD151D_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define SD151D_SHM_NAME         "/sd151"
+#define SD151D_SOCKET           "/run/sd151d.sock"
+#define SD151D_MAGIC            0x53443135      /* "SD15" */
+#define SD151D_VERSION          1
+
+#define SD151D_CHANNELS         3
+#define SD151D_LABEL_LEN        16
+#define SD151D_MAX_FIELDS       32
+#define SD151D_KEY_LEN          16
+#define SD151D_VALUE_LEN        64
+
+struct sd151d_channel {
+	char label[SD151D_LABEL_LEN];
+	int32_t input_mv;
+	int32_t min_mv;
+	int32_t max_mv;
+};
+
+/* One "key : value" line of /proc/sd151 */
+struct sd151d_field {
+	char key[SD151D_KEY_LEN];
+	char value[SD151D_VALUE_LEN];
+};
+
+struct sd151d_snapshot {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;                   /* odd while the daemon writes */
+	uint32_t up;                    /* last sample succeeded */
+	uint64_t timestamp_ms;          /* CLOCK_REALTIME of the last sample */
+	uint64_t interval_ms;
+	uint64_t samples;
+	uint64_t errors;
+	uint64_t sample_us;             /* duration of the last sample */
+	int64_t rtc_time;               /* -1 without RTC */
+	struct sd151d_channel in[SD151D_CHANNELS];
+	uint32_t nfields;
+	struct sd151d_field field[SD151D_MAX_FIELDS];
+};
+
+/* Copy a consistent snapshot, returns 0 on success */
+static inline int sd151d_snapshot_read(const volatile struct sd151d_snapshot *shm,
+				       struct sd151d_snapshot *snap)
+{
+	uint32_t seq;
+	int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		seq = shm->seq;
+		__sync_synchronize();
+		if (seq & 1)
+			continue;
+		memcpy(snap, (const void *)shm, sizeof(*snap));
+		__sync_synchronize();
+		if (shm->seq == seq)
+			return snap->magic == SD151D_MAGIC ? 0 : -1;
+	}
+
+	return -1;
+}
+
+#endif /* _SD151D_H */
@@ -158,24 +158,69 @@ int APP_ChipErase(updiParam *par)
   return 0;
 }
 
+/**
+ * @brief Runs the CRC scanner on the whole flash
+ * @param [in] par updiParam
+ * @return 0 if the CRC is OK, 1 if it does not match, -1 on link error
+ * @details The scanner computes the CRC16-CCITT of the flash including the
+ * checksum stored in its last two bytes: STATUS.OK is set when the result
+ * matches. The scan runs on the target, the link only carries the register
+ * accesses.
+ */
+int APP_CrcScan(updiParam *par)
+{
+  uint16_t crcscan = par->crcscan_address;
+  uint16_t timeout = 1000;
+  uint8_t status;
+
+  // Restart the scanner, it may have run at boot
+  if (!StoreByte(crcscan + UPDI_CRCSCAN_CTRLA, 1 << UPDI_CRCSCAN_CTRLA_RESET_BIT))
+    return -1;
+  if (!StoreByte(crcscan + UPDI_CRCSCAN_CTRLB, UPDI_CRCSCAN_CTRLB_SRC_FLASH))
+    return -1;
+  if (!StoreByte(crcscan + UPDI_CRCSCAN_CTRLA, 1 << UPDI_CRCSCAN_CTRLA_ENABLE_BIT))
+    return -1;
+
+  while (timeout-- > 0)
+  {
+    usleep(1000);
+    status = LoadByte(crcscan + UPDI_CRCSCAN_STATUS);
+    if (!(status & (1 << UPDI_CRCSCAN_STATUS_BUSY_BIT)))
+      return (status & (1 << UPDI_CRCSCAN_STATUS_OK_BIT)) ? 0 : 1;
+  }
+
+  return -1;
+}
+
 /**
  * @brief Writes bytes to memory
  * @param [in] address Flash address
  * @param [in] data incoming buffer
  * @param [in] len buffer size
+ * @param [in] burst stream the block without ACKs
  * @return 0 on success.
+ * @details Even lengths are moved as words (UPDI_DATA_16), which halves the
+ * repeat count and the ACKs; odd lengths fall back to bytes.
  */
-static bool WriteData(uint16_t address, uint8_t *data, uint16_t len)
+static bool WriteData(uint16_t address, uint8_t *data, uint16_t len, bool burst)
 {
+  bool word = !(len & 1);
+
   // Range check
-  if (len > (UPDI_MAX_REPEAT_SIZE + 1))
+  if (len > (UPDI_MAX_REPEAT_SIZE + 1) * (word ? 2 : 1))
     return false;
 
+  if (burst)
+    return StoreByte_ptr_inc_burst(address, data, len, word);
+
   // Store the address
-  StoreByte_ptr(address);
+  if (!StoreByte_ptr(address))
+    return false;
 
   // Fire up the repeat
-  LINK_Repeat(len);
+  LINK_Repeat(word ? len >> 1 : len);
+  if (word)
+    return StoreByte_ptr_inc16(data, len);
   return StoreByte_ptr_inc(data, len);
 }
 
@@ -184,36 +229,56 @@ static bool WriteData(uint16_t address, uint8_t *data, uint16_t len)
  * @param [in] address Flash address
  * @param [out] data outgoing buffer
  * @param [in] len buffer size
- * @return 0 on success.
+ * @return True on success.
+ * @details Even lengths are read as words, as WriteData.
  */
 static bool ReadData(uint16_t address, uint8_t *data, uint16_t size)
 {
+  bool word = !(size & 1);
+
   // Range check
-  if ((size > UPDI_MAX_REPEAT_SIZE + 1) || (size < 2))
+  if ((size > (UPDI_MAX_REPEAT_SIZE + 1) * (word ? 2 : 1)) || (size < 2))
     return false;
 
   // Store the address
-  StoreByte_ptr(address);
+  if (!StoreByte_ptr(address))
+    return false;
 
-  // Fire up the repeat
-  LINK_Repeat(size);
+  // Fire up the repeat, it goes out with the load
+  LINK_Repeat(word ? size >> 1 : size);
 
   // Do the read(s)
-  return LoadByte_ptr_inc(data, size);
+  if (word)
+    return LoadByte_ptr_inc16(data, size >> 1) == size;
+  return LoadByte_ptr_inc(data, size) == size;
 }
 
 /**
- * @brief Writes a page of data to NVM
+ * @brief Read words from memory
+ * @param [in] address Flash address
+ * @param [out] data outgoing buffer, words * 2 bytes
+ * @param [in] words number of words
+ * @return True on success.
+ */
+bool APP_ReadDataWords(uint16_t address, uint8_t *data, uint16_t words)
+{
+  return ReadData(address, data, words << 1);
+}
+
+/**
+ * @brief Loads the page buffer and commits it to NVM
  * @param [in] par updiParam struct
  * @param [in] address Flash address
  * @param [in] data incoming buffer
+ * @param [in] command UPDI_NVMCTRL_CTRLA_WRITE_PAGE or
+ * UPDI_NVMCTRL_CTRLA_ERASE_WRITE_PAGE
  * @return 0 on success.
  * @details
- * By default the PAGE_WRITE command is used, which
- * requires that the page is already erased.
  * By default word access is used (flash)
+ * With par->burst the page buffer is loaded in a single transmission, a
+ * load error is reported by STATUSB and the write by the NVM status.
  */
-int PageWrite(updiParam *par, uint16_t address, uint8_t *data)
+static int PageCommit(updiParam *par, uint16_t address, uint8_t *data, uint8_t command)
 {
   uint16_t len = par->flash_pagesize;
   // Check that NVM controller is ready
@@ -228,10 +293,11 @@ int PageWrite(updiParam *par, uint16_t address, uint8_t *data)
     return -1;
 
   // Load the page buffer by writing directly to location
-  WriteData(address, data, len);
+  if (!WriteData(address, data, len, par->burst))
+    return -1;
 
   // Write the page to NVM, maybe erase first
-  ExecCommand(par,UPDI_NVMCTRL_CTRLA_WRITE_PAGE);
+  ExecCommand(par,command);
 
   // Wait for NVM controller to be ready again
   if (!WaitFlashReady(par))
@@ -240,6 +306,36 @@ int PageWrite(updiParam *par, uint16_t address, uint8_t *data)
   return 0;
 }
 
+/**
+ * @brief Writes a page of data to NVM
+ * @param [in] par updiParam struct
+ * @param [in] address Flash address
+ * @param [in] data incoming buffer
+ * @return 0 on success.
+ * @details
+ * The PAGE_WRITE command is used, which requires that the page is already
+ * erased.
+ */
+int PageWrite(updiParam *par, uint16_t address, uint8_t *data)
+{
+  return PageCommit(par, address, data, UPDI_NVMCTRL_CTRLA_WRITE_PAGE);
+}
+
+/**
+ * @brief Erases a page and writes it with new data
+ * @param [in] par updiParam struct
+ * @param [in] address Flash address
+ * @param [in] data incoming buffer
+ * @return 0 on success.
+ * @details
+ * The ERASE_WRITE_PAGE command erases the page and writes the page buffer
+ * in one NVM operation, the rest of the flash is untouched.
+ */
+int PageEraseWrite(updiParam *par, uint16_t address, uint8_t *data)
+{
+  return PageCommit(par, address, data, UPDI_NVMCTRL_CTRLA_ERASE_WRITE_PAGE);
+}
+
 /**
  * @brief Read page from memory
  * @param [in] address Flash address
@@ -273,7 +369,7 @@ int PageErase(updiParam *par, uint16_t address)
     return -1;
 
   //SetErasePage(address);
-  WriteData(address, data, 64);
+  WriteData(address, data, 64, par->burst);
 
   // Write the page to NVM, maybe erase first
   ExecCommand(par,UPDI_NVMCTRL_CTRLA_ERASE_PAGE);
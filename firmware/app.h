@@ -10,9 +10,11 @@ void ExitProgmode(void);
 bool APP_WaitFlashReady(updiParam *);
 bool APP_Unlock(void);
 int APP_ChipErase(updiParam *);
+int APP_CrcScan(updiParam *);
 bool APP_ReadDataWords(uint16_t address, uint8_t *data, uint16_t words);
 //bool APP_WriteData(uint16_t address, uint8_t *data, uint16_t len);
 int PageWrite(updiParam *, uint16_t, uint8_t *);
+int PageEraseWrite(updiParam *, uint16_t, uint8_t *);
 int PageRead(updiParam *, uint16_t, uint8_t *);
 bool APP_ReadData(uint16_t address, uint8_t *data, uint16_t size);
 int PageErase(updiParam *, uint16_t);
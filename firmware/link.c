@@ -1,8 +1,99 @@
 #include <string.h>
 #include "phy.h"
+#include "link.h"
 #include "nvm.h"
 #include "updi.h"
 
+/*
+ * Outgoing frame: instructions that expect no response before the next one
+ * (STCS, REPEAT, and the instruction after a REPEAT) are appended here and go
+ * out with a single PHY_Send, together with the instruction that waits for
+ * the response.
+ */
+static uint8_t loc_frame[UINT8_MAX];
+static uint8_t loc_frame_len;
+
+/* CS CTRLA value: guard time and inter-byte delay, see LINK_Config */
+static uint8_t loc_ctrla = UPDI_CTRLA_GTVAL_128;
+
+/**
+ * @brief Send the pending frame
+ * @return 0 on success
+ */
+static int frame_send(void)
+{
+  uint8_t len = loc_frame_len;
+
+  if (!len)
+    return 0;
+
+  loc_frame_len = 0;
+  return PHY_Send(loc_frame, len);
+}
+
+/**
+ * @brief Append bytes to the pending frame
+ * @param [in] data bytes to append
+ * @param [in] len number of bytes
+ * @return None
+ * @details When the bytes do not fit the pending frame is sent first: no
+ * response is expected in between, so the split is invisible to the target.
+ */
+static void frame_add(const uint8_t *data, uint16_t len)
+{
+  if (loc_frame_len + len > sizeof(loc_frame))
+    frame_send();
+
+  while (len > sizeof(loc_frame)) {
+    PHY_Send((uint8_t *)data, sizeof(loc_frame));
+    data += sizeof(loc_frame);
+    len -= sizeof(loc_frame);
+  }
+
+  memcpy(&loc_frame[loc_frame_len], data, len);
+  loc_frame_len += len;
+}
+
+/**
+ * @brief Queue a store to Control/Status space
+ * @param [in] address
+ * @param [in] value
+ * @return None
+ */
+static void frame_stcs(uint8_t address, uint8_t value)
+{
+  uint8_t buf[] = {UPDI_PHY_SYNC, UPDI_STCS | (address & 0x0F), value};
+
+  frame_add(buf, sizeof(buf));
+}
+
+/**
+ * @brief Send bytes after the pending frame
+ * @param [in] data buffer
+ * @param [in] len buffer size
+ * @return 0 on success
+ */
+static int link_send(const uint8_t *data, uint16_t len)
+{
+  frame_add(data, len);
+  return frame_send();
+}
+
+/**
+ * @brief Set the guard time and the inter-byte delay
+ * @param [in] gtval CTRLA GTVAL field, UPDI_CTRLA_GTVAL_128 .. UPDI_CTRLA_GTVAL_2
+ * @param [in] ibdly true to have the target insert two idle bits between
+ * the bytes it sends
+ * @return None
+ * @details Applied by LinkInit.
+ */
+void LINK_Config(uint8_t gtval, bool ibdly)
+{
+  loc_ctrla = (gtval & UPDI_CTRLA_GTVAL_MASK);
+  if (ibdly)
+    loc_ctrla |= 1 << UPDI_CTRLA_IBDLY_BIT;
+}
+
 /**
  * @brief Load data from Control/Status space
  * @param [in] address
@@ -13,7 +104,7 @@ uint8_t load_cs(uint8_t address)
   uint8_t response = 0;
   uint8_t buf[] = {UPDI_PHY_SYNC, UPDI_LDCS | (address & 0x0F)};
 
-  PHY_Send(buf, sizeof(buf));
+  link_send(buf, sizeof(buf));
   PHY_Receive(&response, 1);
   return response;
 }
@@ -26,9 +117,8 @@ uint8_t load_cs(uint8_t address)
  */
 void store_cs(uint8_t address, uint8_t value)
 {
-  uint8_t buf[] = {UPDI_PHY_SYNC, UPDI_STCS | (address & 0x0F), value};
-
-  PHY_Send(buf, sizeof(buf));
+  frame_stcs(address, value);
+  frame_send();
 }
 
 /**
@@ -43,14 +133,15 @@ static bool CheckLink(void)
 }
 
 /**
- * @brief Set the inter-byte delay bit and disable collision detection
+ * @brief Disable collision detection, set guard time and inter-byte delay
  * @param None
  * @return None
+ * @details Both stores go out in the same frame as the STATUSA check.
  */
 static void LinkStart(void)
 {
-  store_cs(UPDI_CS_CTRLB, 1 << UPDI_CTRLB_CCDETDIS_BIT);
-  store_cs(UPDI_CS_CTRLA, 1 << UPDI_CTRLA_IBDLY_BIT);
+  frame_stcs(UPDI_CS_CTRLB, 1 << UPDI_CTRLB_CCDETDIS_BIT);
+  frame_stcs(UPDI_CS_CTRLA, loc_ctrla);
 }
 
 /**
@@ -64,6 +155,7 @@ int LinkInit(void)
 
   while (err-- > 0)
   {
+    loc_frame_len = 0;
     DoubleBreak();
 
     LinkStart();
@@ -89,7 +181,7 @@ uint8_t LoadByte(uint16_t address)
   uint8_t response;
   uint8_t buf[] = {UPDI_PHY_SYNC, UPDI_LDS | UPDI_ADDRESS_16 | UPDI_DATA_8, address & 0xFF, (address >> 8) & 0xFF};
 
-  PHY_Send(buf, sizeof(buf));
+  link_send(buf, sizeof(buf));
   PHY_Receive(&response, 1);
   return response;
 }
@@ -106,13 +198,13 @@ bool StoreByte(uint16_t address, uint8_t value)
   uint8_t buf[] = {UPDI_PHY_SYNC, UPDI_STS | UPDI_ADDRESS_16 | UPDI_DATA_8, address & 0xFF, (address >> 8) & 0xFF};
 
   // prepare for write
-  PHY_Send(buf, sizeof(buf));
+  link_send(buf, sizeof(buf));
   PHY_Receive(&response, 1);
   if (response != UPDI_PHY_ACK)
     return false;
 
   // write byte
-  PHY_Send(&value, 1);
+  link_send(&value, 1);
   PHY_Receive(&response, 1);
   if (response != UPDI_PHY_ACK)
     return false;
@@ -131,11 +223,27 @@ int LoadByte_ptr_inc(uint8_t *data, uint8_t size)
 {
   uint8_t buf[] = {UPDI_PHY_SYNC, UPDI_LD | UPDI_PTR_INC | UPDI_DATA_8};
 
-  PHY_Send(buf, sizeof(buf));
+  link_send(buf, sizeof(buf));
 
   return PHY_Receive(data, size);
 }
 
+/**
+ * @brief Loads a number of words from the pointer location with pointer
+ * post-increment
+ * @param [out] data buffer, words * 2 bytes, little endian
+ * @param [in] words number of words
+ * @return num of rx bytes.
+ */
+int LoadByte_ptr_inc16(uint8_t *data, uint16_t words)
+{
+  uint8_t buf[] = {UPDI_PHY_SYNC, UPDI_LD | UPDI_PTR_INC | UPDI_DATA_16};
+
+  link_send(buf, sizeof(buf));
+
+  return PHY_Receive(data, words << 1);
+}
+
 /**
  * @brief Set the pointer location
  * @param [in] address
@@ -147,7 +255,7 @@ bool StoreByte_ptr(uint16_t address)
   uint8_t response;
   uint8_t buf[] = {UPDI_PHY_SYNC, UPDI_ST | UPDI_PTR_ADDRESS | UPDI_DATA_16, address & 0xFF, (address >> 8) & 0xFF};
 
-  PHY_Send(buf, sizeof(buf));
+  link_send(buf, sizeof(buf));
   PHY_Receive(&response, 1);
   if (response != UPDI_PHY_ACK)
     return false;
@@ -168,7 +276,7 @@ bool StoreByte_ptr_inc(uint8_t *data, uint16_t len)
   uint16_t n;
   uint8_t buf[] = {UPDI_PHY_SYNC, UPDI_ST | UPDI_PTR_INC | UPDI_DATA_8, data[0]};
 
-  PHY_Send(buf, sizeof(buf));
+  link_send(buf, sizeof(buf));
   PHY_Receive(&response, 1);
   if (response != UPDI_PHY_ACK)
     return false;
@@ -176,7 +284,7 @@ bool StoreByte_ptr_inc(uint8_t *data, uint16_t len)
   n = 1;
   while (n < len)
   {
-    PHY_Send(&data[n], sizeof(uint8_t));
+    link_send(&data[n], 1);
     PHY_Receive(&response, 1);
     if (response != UPDI_PHY_ACK)
       return false;
@@ -187,19 +295,83 @@ bool StoreByte_ptr_inc(uint8_t *data, uint16_t len)
 }
 
 
-/** \brief
- *
- * \param
- * \param
- * \return
- *
+/**
+ * @brief Store words to the pointer location with pointer post-increment
+ * @param [in] data buffer to write, little endian
+ * @param [in] len buffer size in bytes, even
+ * @return True if success.
+ * @details One ACK is returned per word.
+ */
+bool StoreByte_ptr_inc16(uint8_t *data, uint16_t len)
+{
+  uint8_t response;
+  uint16_t n;
+  uint8_t buf[] = {UPDI_PHY_SYNC, UPDI_ST | UPDI_PTR_INC | UPDI_DATA_16, data[0], data[1]};
+
+  link_send(buf, sizeof(buf));
+  PHY_Receive(&response, 1);
+  if (response != UPDI_PHY_ACK)
+    return false;
+
+  n = 2;
+  while (n < len)
+  {
+    link_send(&data[n], 2);
+    PHY_Receive(&response, 1);
+    if (response != UPDI_PHY_ACK)
+      return false;
+    n += 2;
+  }
+
+  return true;
+}
+
+/**
+ * @brief Store data from an address with pointer post-increment, without
+ * response signatures
+ * @param [in] address start address
+ * @param [in] data buffer to write
+ * @param [in] len buffer size
+ * @param [in] word store words (UPDI_DATA_16), len must be even
+ * @return True if success.
+ * @details With RSD set the target sends no ACK, so setting RSD, the
+ * pointer, the repeat, the block, clearing RSD and the STATUSB load go out
+ * as one frame. Errors are read back from the PESIG field of STATUSB.
+ */
+bool StoreByte_ptr_inc_burst(uint16_t address, uint8_t *data, uint16_t len, bool word)
+{
+  uint16_t repeats = word ? len >> 1 : len;
+  uint8_t ptr[] = {UPDI_PHY_SYNC, UPDI_ST | UPDI_PTR_ADDRESS | UPDI_DATA_16, address & 0xFF, (address >> 8) & 0xFF};
+  uint8_t st[] = {UPDI_PHY_SYNC, UPDI_ST | UPDI_PTR_INC | (word ? UPDI_DATA_16 : UPDI_DATA_8)};
+
+  if (!repeats)
+    return false;
+
+  frame_stcs(UPDI_CS_CTRLA, loc_ctrla | (1 << UPDI_CTRLA_RSD_BIT));
+  frame_add(ptr, sizeof(ptr));
+  LINK_Repeat(repeats);
+  frame_add(st, sizeof(st));
+  frame_add(data, len);
+  frame_stcs(UPDI_CS_CTRLA, loc_ctrla);
+
+  if (load_cs(UPDI_CS_STATUSB) & (0x07 << UPDI_ASI_STATUSB_PESIG))
+    return false;
+
+  return true;
+}
+
+/**
+ * @brief Store a value to the repeat counter
+ * @param [in] repeats number of times the next instruction runs
+ * @return None
+ * @details REPEAT has no response and is always followed by the instruction
+ * it repeats, so it is only queued and goes out in the same frame.
  */
 void LINK_Repeat(uint16_t repeats)
 {
-  //Store a value to the repeat counter
   uint8_t buf[] = {UPDI_PHY_SYNC, UPDI_REPEAT | UPDI_REPEAT_WORD, (repeats - 1) & 0xFF, ((repeats - 1) >> 8) & 0xFF};
 
-  PHY_Send(buf, sizeof(buf));
+  frame_add(buf, sizeof(buf));
 }
 
 /** \brief
@@ -219,7 +391,7 @@ bool SendKey(char *key, uint8_t size)
   if (strlen(key) != (8 << size))
     return false;
 
-  PHY_Send(buf, sizeof(buf));
+  frame_add(buf, sizeof(buf));
   n = strlen(key);
   i = 0;
   while (n > 0)
@@ -227,7 +399,7 @@ bool SendKey(char *key, uint8_t size)
     data[i++] = key[n - 1];
     n--;
   }
-  PHY_Send(data, sizeof(data));
+  link_send(data, sizeof(data));
 
   return true;
 }
@@ -16,7 +16,9 @@ int LoadByte_ptr_inc(uint8_t *data, uint8_t size);
 int LoadByte_ptr_inc16(uint8_t *data, uint16_t words);
 bool StoreByte_ptr(uint16_t address);
 bool StoreByte_ptr_inc(uint8_t *data, uint16_t len);
+bool StoreByte_ptr_inc_burst(uint16_t address, uint8_t *data, uint16_t len, bool word);
 bool StoreByte_ptr_inc16(uint8_t *data, uint16_t len);
+void LINK_Config(uint8_t gtval, bool ibdly);
 int LinkInit(void);
 
 #endif
@@ -134,9 +134,9 @@ int FlashBlankCheck(updiParam *par)
     usleep(2000);
   }
 
-  // Find the number of pages
-  pages = par->flash_size / page_size;
-  if (par->flash_size % page_size != 0)
+  // Only the pages the image occupies
+  pages = par->flash_max_used / page_size;
+  if (par->flash_max_used % page_size != 0)
     pages++;
 
   i = 0;
@@ -193,6 +193,8 @@ int FlashBlankCheck(updiParam *par)
  * @details
  * Program and verify every sector. In case a sector is still erased a write is
  * made again. In case of bad write a page erase and rewrite is made.
+ * Without the chip erase phase every page is written with ERASE_WRITE_PAGE,
+ * so erase and write are a single NVM operation.
  */
 int FlashProgram(updiParam *par)
 {
@@ -207,6 +209,7 @@ int FlashProgram(updiParam *par)
   uint16_t address = par->flash_start;
   uint8_t rdata[page_size];
   char note[128];
+  bool erase_write = !(par->phases & PHASE_ERASE);
 
   if (moduleProgmode == false) {
     /* Reset MCU and initialize link */
@@ -236,7 +239,8 @@ int FlashProgram(updiParam *par)
 #endif
     pdata = par->flash_data + (i*page_size);
     if (!err_link) {
-      if (PageWrite(par, address, pdata)) {
+      if (erase_write ? PageEraseWrite(par, address, pdata) :
+                        PageWrite(par, address, pdata)) {
         err_write++;
 #if USE_PROGRESS==1
         sprintf(note,"Error %d on writing page: %d\n",err_write,i);
@@ -368,9 +372,9 @@ int FlashVerify(updiParam *par)
     usleep(2000);
   }
 
-  // Find the number of pages
-  pages = par->flash_size / page_size;
-  if (par->flash_size % page_size != 0)
+  // Only the pages the image occupies
+  pages = par->flash_max_used / page_size;
+  if (par->flash_max_used % page_size != 0)
     pages++;
 
   i = 0;
@@ -420,3 +424,273 @@ int FlashVerify(updiParam *par)
 
   return 0;
 }
+
+/**
+ * @brief Flash update
+ * @param [in] par updiParam
+ * @return number of pages rewritten, negative on error
+ * @details
+ * Differential reflash: every page of the device is read and compared with
+ * the image, only the pages that differ are written with ERASE_WRITE_PAGE
+ * and read back again. Pages past the image are compared with the erased
+ * value, so a leftover of a longer firmware is cleared too.
+ */
+int FlashUpdate(updiParam *par)
+{
+  uint8_t *pdata;
+  uint16_t i;
+  uint16_t pages;
+  uint16_t changed = 0;
+  uint16_t address = par->flash_start;
+  uint8_t page_size = par->flash_pagesize;
+  uint8_t err_link = 0;
+  uint8_t err_write = 0;
+  uint8_t data[page_size];
+
+  if (moduleProgmode == false) {
+    /* Reset MCU and initialize link */
+    LinkInit();
+    usleep(2000);
+  }
+
+  // Find the number of pages
+  pages = par->flash_size / page_size;
+  if (par->flash_size % page_size != 0)
+    pages++;
+
+  i = 0;
+
+  PROGRESS_Print(0, pages, "Updating: ", '#', "");
+
+  while (i < pages)
+  {
+    if (PageRead(par,address,data))
+    {
+      // error occurred, try once more
+      if (++err_link > VERIFY_MAX_LINK_ERROR)
+      {
+        printf("Error reading page %d/%d\n",i,pages);
+        PROGRESS_Break();
+        return -1;
+      }
+      /* Reset MCU and initialize link */
+      LinkInit();
+      usleep(5000);  // wait for 5ms before reply
+      continue;
+    }
+
+    // rewrite the page while it differs, the next read checks the write
+    pdata = par->flash_data + (i*page_size);
+    if (PageVerify(data,pdata,page_size))
+    {
+      if (++err_write > NVM_MAX_ERRORS)
+      {
+        printf("Error writing page %d/%d\n",i,pages);
+        PROGRESS_Break();
+        return -2;
+      }
+      if (PageEraseWrite(par, address, pdata)) {
+        /* Reset MCU and initialize link */
+        LinkInit();
+        usleep(5000);  // wait for 5ms
+      }
+      continue;
+    }
+
+    if (err_write)
+      changed++;
+
+    i++;
+    address += page_size;
+    err_link = 0;
+    err_write = 0;
+    PROGRESS_Print(i, pages, "Updating: ", '#', "");
+  }
+
+  return changed;
+}
+
+/**
+ * @brief CRC16-CCITT as computed by the CRC scanner
+ * @param [in] data buffer
+ * @param [in] size buffer size
+ * @return crc
+ * @details Polynomial 0x1021, initial value 0xFFFF, MSB first. Appending the
+ * result high byte first makes the CRC of the whole buffer zero, which is
+ * what the scanner checks.
+ */
+static uint16_t Crc16(uint8_t *data, uint16_t size)
+{
+  uint16_t crc = 0xFFFF;
+  uint8_t bit;
+
+  while (size--)
+  {
+    crc ^= (uint16_t)(*data++) << 8;
+    for (bit = 0; bit < 8; bit++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+
+  return crc;
+}
+
+/**
+ * @brief Store the flash checksum in the image
+ * @param [in] par updiParam
+ * @return 0 on success, -1 if the last two bytes are used by the firmware
+ * @details The CRC of the image is written high byte first in the last two
+ * bytes of the flash. flash_max_used is left alone: FlashWriteChecksum
+ * programs the last page when the image does not reach it.
+ */
+int FlashAddChecksum(updiParam *par)
+{
+  uint8_t *pt = par->flash_data + par->flash_size - 2;
+  uint16_t crc;
+
+  if (par->flash_max_used > par->flash_size - 2)
+    return -1;
+
+  crc = Crc16(par->flash_data, par->flash_size - 2);
+  pt[0] = crc >> 8;
+  pt[1] = crc & 0xFF;
+
+  return 0;
+}
+
+/**
+ * @brief Program the page holding the checksum
+ * @param [in] par updiParam
+ * @return 0 on success, -1 otherwise
+ * @details The last page is written and read back. Without the chip erase
+ * phase the pages between the image and the checksum still hold the old
+ * firmware, which the CRC scanner would see: they are erased first and read
+ * back blank. Nothing to do when the image reaches the last page,
+ * FlashProgram has written it.
+ */
+int FlashWriteChecksum(updiParam *par)
+{
+  uint8_t page_size = par->flash_pagesize;
+  uint16_t offset = par->flash_size - page_size;
+  uint16_t address = par->flash_start + offset;
+  uint8_t *pdata = par->flash_data + offset;
+  uint16_t gap;
+  uint8_t err = 0;
+  uint8_t rdata[page_size];
+  int ret;
+
+  if (par->flash_max_used > offset)
+    return 0;
+
+  if (moduleProgmode == false) {
+    /* Reset MCU and initialize link */
+    LinkInit();
+    usleep(2000);
+  }
+
+  // First page past the image
+  gap = par->flash_max_used / page_size;
+  if (par->flash_max_used % page_size != 0)
+    gap++;
+  gap *= page_size;
+
+  while (!(par->phases & PHASE_ERASE) && gap < offset)
+  {
+    if (!PageErase(par, par->flash_start + gap) &&
+        !PageRead(par, par->flash_start + gap, rdata) &&
+        !PageblanckCheck(rdata, page_size)) {
+      gap += page_size;
+      continue;
+    }
+
+    if (++err > NVM_MAX_ERRORS)
+    {
+      printf("Error erasing page at %04x\n", par->flash_start + gap);
+      return -1;
+    }
+    /* Reset MCU and initialize link */
+    LinkInit();
+    usleep(5000);  // wait for 5ms
+  }
+
+  err = 0;
+  while (1)
+  {
+    // the page is erased only by the chip erase phase
+    if (par->phases & PHASE_ERASE)
+      ret = PageWrite(par, address, pdata);
+    else
+      ret = PageEraseWrite(par, address, pdata);
+
+    if (!ret && !PageRead(par, address, rdata) &&
+                              !PageVerify(rdata, pdata, page_size))
+      return 0;
+
+    if (++err > NVM_MAX_ERRORS)
+    {
+      printf("Error writing the checksum page\n");
+      return -1;
+    }
+    /* Reset MCU and initialize link */
+    LinkInit();
+    usleep(5000);  // wait for 5ms
+  }
+}
+
+/**
+ * @brief Flash verify by CRC
+ * @param [in] par updiParam
+ * @return 0 on success, -1 otherwise
+ * @details
+ * The checksum stored on the device is read back and compared with the one
+ * of the image, then the CRC scanner checks the whole flash against it: a
+ * few bytes of traffic instead of reading the flash back.
+ */
+int FlashVerifyCRC(updiParam *par)
+{
+  uint8_t *pt = par->flash_data + par->flash_size - 2;
+  uint8_t stored[2];
+  uint8_t err_link = 0;
+  int ret;
+
+  if (moduleProgmode == false) {
+    /* Reset MCU and initialize link */
+    LinkInit();
+    usleep(2000);
+  }
+
+  if (Crc16(par->flash_data, par->flash_size) != 0) {
+    printf("Image has no checksum\n");
+    return -1;
+  }
+
+  while (1)
+  {
+    ret = -1;
+    if (APP_ReadDataWords(par->flash_start + par->flash_size - 2, stored, 1)) {
+      // a stale firmware has a valid CRC too
+      if (memcmp(stored, pt, 2)) {
+        printf("Checksum on device %02x%02x, expected %02x%02x\n",
+                                  stored[0], stored[1], pt[0], pt[1]);
+        return -1;
+      }
+      ret = APP_CrcScan(par);
+    }
+
+    if (ret == 0)
+      return 0;
+    if (ret > 0) {
+      printf("CRC scan failed\n");
+      return -1;
+    }
+
+    // link error, try once more
+    if (++err_link > VERIFY_MAX_LINK_ERROR)
+    {
+      printf("Error reading CRC status\n");
+      return -1;
+    }
+    /* Reset MCU and initialize link */
+    LinkInit();
+    usleep(5000);  // wait for 5ms before reply
+  }
+}
@@ -21,5 +21,9 @@ int FlashBlankCheck(updiParam *);
 int ChipErase(updiParam *);
 int FlashProgram(updiParam *);
 int FlashVerify(updiParam *);
+int FlashUpdate(updiParam *);
+int FlashAddChecksum(updiParam *);
+int FlashWriteChecksum(updiParam *);
+int FlashVerifyCRC(updiParam *);
 
 #endif
@@ -7,6 +7,20 @@
 
 #define PHY_BAUDRATE      (115200)
 
+/* PHY backend, selected by PHY_Init from updiParam.port */
+typedef struct
+{
+  const char *name;
+  int  (*init)(updiParam *);
+  int  (*double_break)(void);
+  int  (*send)(uint8_t *data, uint8_t len);
+  int  (*receive)(uint8_t *data, uint16_t len);
+  void (*close)(void);
+} phyOps;
+
+extern const phyOps phy_gpio;
+extern const phyOps phy_uart;
+
 int PHY_Init(updiParam *);
 int DoubleBreak(void);
 int PHY_Send(uint8_t *data, uint8_t len);
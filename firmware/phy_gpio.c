@@ -0,0 +1,464 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "phy.h"
+#include "updi.h"
+
+/*
+ * Bit-banged PHY: the UPDI line is a GPIO driven and sampled in software.
+ * Needs no extra wiring; the speed is limited by the timing accuracy.
+ * Pins are BCM GPIO numbers, accessed through the registers mapped from
+ * /dev/gpiomem (BCM2835..BCM2711, not the RP1 of the Raspberry Pi 5).
+ */
+
+static int loc_updi_pin=-1;
+#ifdef DEBUG_PIN
+static int loc_debug_pin=-1;
+#endif
+
+#define RX_START_BIT_TIMEOUT  5000      /* in 1/8 bit */
+#define TX_IDLE_BITS          2         /* line high before the first start bit */
+#define TX_STOP_BITS          2
+#define RT_PRIORITY           90
+#define SPIN_MIN_NS           20000
+#define CALIBRATE_LOOPS       200
+
+/****************************************************************************
+ * GPIO REGISTERS
+ ****************************************************************************/
+
+#define GPIOMEM_DEVICE        "/dev/gpiomem"
+#define GPIOMEM_SIZE          4096
+
+/* Register word offsets */
+#define GPFSEL0               0
+#define GPSET0                7
+#define GPCLR0                10
+#define GPLEV0                13
+
+#define INPUT                 0
+#define OUTPUT                1
+
+static volatile uint32_t *loc_gpio;
+
+/* Every access is one register read or write, no library call per bit */
+static inline void gpio_mode(int pin, int mode)
+{
+  volatile uint32_t *fsel = loc_gpio + GPFSEL0 + pin / 10;
+  int shift = (pin % 10) * 3;
+
+  *fsel = (*fsel & ~(7u << shift)) | ((uint32_t)mode << shift);
+}
+
+static inline void gpio_write(int pin, int level)
+{
+  loc_gpio[(level ? GPSET0 : GPCLR0) + pin / 32] = 1u << (pin % 32);
+}
+
+static inline int gpio_read(int pin)
+{
+  return (loc_gpio[GPLEV0 + pin / 32] >> (pin % 32)) & 1;
+}
+
+/**
+ * @brief Map the GPIO registers
+ * @return 0 if success
+ */
+static int gpio_map(void)
+{
+  void *map;
+  int fd;
+
+  fd = open(GPIOMEM_DEVICE, O_RDWR | O_SYNC);
+  if (fd < 0) {
+    printf("Cannot open %s\n", GPIOMEM_DEVICE);
+    return -errno;
+  }
+
+  map = mmap(NULL, GPIOMEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -errno;
+
+  loc_gpio = map;
+
+  return 0;
+}
+
+/****************************************************************************
+ * BIT TIMING
+ ****************************************************************************/
+
+/*
+ * Every bit edge has an absolute deadline, one bit after the previous one,
+ * so a late wake up does not shift the rest of the frame. The thread sleeps
+ * until loc_spin_ns before the deadline and spins on the clock for the rest;
+ * loc_spin_ns is the measured worst wake up latency of clock_nanosleep.
+ */
+
+typedef struct
+{
+  uint64_t  count;
+  uint64_t  late;                       /* later than 1/4 bit */
+  int64_t   min_ns;
+  int64_t   max_ns;
+  int64_t   total_ns;
+} jitterStats;
+
+static struct timespec loc_deadline;
+static int64_t loc_bit_ns;
+static int64_t loc_spin_ns;
+static jitterStats loc_jitter;
+
+static int64_t ts_ns(const struct timespec *ts)
+{
+  return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void ns_ts(int64_t ns, struct timespec *ts)
+{
+  ts->tv_sec = ns / 1000000000LL;
+  ts->tv_nsec = ns % 1000000000LL;
+}
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts_ns(&ts);
+}
+
+/**
+ * @brief Restart the deadline chain
+ * @param [in] offset_ns first deadline is now + offset_ns
+ */
+static void deadline_start(int64_t offset_ns)
+{
+  ns_ts(now_ns() + offset_ns, &loc_deadline);
+}
+
+/**
+ * @brief Wait for the next deadline
+ * @param [in] ns time from the previous deadline
+ */
+static void deadline_wait(int64_t ns)
+{
+  struct timespec wake;
+  int64_t deadline = ts_ns(&loc_deadline) + ns;
+  int64_t t, late;
+
+  ns_ts(deadline, &loc_deadline);
+
+  if (deadline - now_ns() > loc_spin_ns) {
+    ns_ts(deadline - loc_spin_ns, &wake);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+      ;
+  }
+
+  while ((t = now_ns()) < deadline)
+    ;
+
+  late = t - deadline;
+  if (!loc_jitter.count || late < loc_jitter.min_ns)
+    loc_jitter.min_ns = late;
+  if (late > loc_jitter.max_ns)
+    loc_jitter.max_ns = late;
+  if (late > loc_bit_ns / 4)
+    loc_jitter.late++;
+  loc_jitter.total_ns += late;
+  loc_jitter.count++;
+}
+
+/**
+ * @brief Measure the wake up latency of an absolute sleep
+ * @return spin window in ns
+ */
+static int64_t deadline_calibrate(void)
+{
+  struct timespec wake;
+  int64_t target, over, worst = 0;
+  int i;
+
+  for (i = 0; i < CALIBRATE_LOOPS; i++) {
+    target = now_ns() + 100000;
+    ns_ts(target, &wake);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+    over = now_ns() - target;
+    if (over > worst)
+      worst = over;
+  }
+
+  /* Some margin over the worst case seen */
+  worst += worst / 2;
+
+  return (worst < SPIN_MIN_NS) ? SPIN_MIN_NS : worst;
+}
+
+/**
+ * @brief Isolate the programmer from the rest of the system
+ * @details SCHED_FIFO, memory locked and pinned to the last CPU. Failures
+ * are reported but not fatal, the timing is only less accurate.
+ */
+static void realtime_setup(void)
+{
+  struct sched_param sp = { .sched_priority = RT_PRIORITY };
+  cpu_set_t cpus;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE))
+    printf("WARNING: mlockall failed\n");
+
+  if (ncpu > 1) {
+    CPU_ZERO(&cpus);
+    CPU_SET(ncpu - 1, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus))
+      printf("WARNING: cannot pin to CPU %ld\n", ncpu - 1);
+  }
+
+  if (sched_setscheduler(0, SCHED_FIFO, &sp))
+    printf("WARNING: cannot set SCHED_FIFO\n");
+}
+
+/****************************************************************************
+ * GPIO PHY
+ ****************************************************************************/
+
+/**
+ * @brief Initialize physical interface
+ *
+ * @param [in] updi programmer parameters, updi_pin and baudrate are used
+ * @return 0 if success
+ *
+ */
+static int gpio_init(updiParam *updi)
+{
+  int err;
+
+  if (!updi->baudrate)
+    return -EINVAL;
+
+  if (updi->updi_pin < 0 || updi->updi_pin > 53)
+    return -EINVAL;
+
+  err = gpio_map();
+  if (err)
+    return err;
+
+  gpio_write (updi->updi_pin, 1) ;       // End reset
+  gpio_mode (updi->updi_pin, INPUT) ;
+  loc_updi_pin = updi->updi_pin;
+
+#ifdef DEBUG_PIN
+  gpio_mode (updi->debug_pin, OUTPUT) ;
+  gpio_write (updi->debug_pin, 0) ;
+  loc_debug_pin = updi->debug_pin;
+#endif
+
+  realtime_setup();
+
+  loc_bit_ns = 1000000000LL / updi->baudrate;
+  loc_spin_ns = deadline_calibrate();
+  memset(&loc_jitter, 0, sizeof(loc_jitter));
+
+  printf("GPIO PHY: %u baud, bit %lld ns, spin %lld ns\n", updi->baudrate,
+    (long long)loc_bit_ns, (long long)loc_spin_ns);
+
+  return 0;
+}
+
+/**
+ * @brief Sends a double break to reset the UPDI port
+ * @param none
+ * @return always 0 (success)
+ * @details BREAK is actually just a slower zero frame. A double break is
+ * guaranteed to push the UPDI state machine into a known state,
+ * albeit rather brutally
+ *
+ */
+static int gpio_double_break(void)
+{
+  if (loc_updi_pin == -1)
+    return -EIO;
+
+  /* Set updi pin as output and force it to 0 */
+  gpio_write (loc_updi_pin, 0) ;       // Start reset
+  gpio_mode (loc_updi_pin, OUTPUT) ;
+  usleep(40000);  // wait for 40ms second
+  gpio_write (loc_updi_pin, 1) ;       // End reset
+  usleep(50000);  // wait for 50ms second
+  gpio_write (loc_updi_pin, 0) ;       // Start reset
+  usleep(40000);  // wait for 40ms second
+  gpio_write (loc_updi_pin, 1) ;       // End reset
+  usleep(10000);  // wait for 10ms second
+
+  return 0;
+}
+
+/** \brief Send data to physical interface
+ *
+ * \param [in] data Buffer with data
+ * \param [in] len Length of data buffer
+ * \return true if success
+ *
+ */
+static int gpio_send(uint8_t *data, uint8_t len)
+{
+  uint8_t  i,bit;
+  uint8_t  *pt=data;
+  uint8_t  byte2send;
+  uint8_t  parity = 0;
+
+  if (loc_updi_pin == -1)
+    return -1;
+
+  gpio_write (loc_updi_pin, 1) ;       // End reset
+  gpio_mode (loc_updi_pin, OUTPUT) ;
+  deadline_start(0);
+  deadline_wait(TX_IDLE_BITS*loc_bit_ns);
+
+  for (i = 0; i < len; i++)
+  {
+    byte2send = *pt++;
+
+    /* send start bit */
+    gpio_write (loc_updi_pin, 0) ;
+    deadline_wait(loc_bit_ns);
+    parity=0;
+    /* send byte */
+    for (bit=0;bit<8;bit++) {
+      gpio_write (loc_updi_pin, (byte2send&1)) ;
+      deadline_wait(loc_bit_ns);
+      if (byte2send&1)
+        parity++;
+      byte2send = byte2send>>1;
+    }
+    /* Send parity */
+    gpio_write (loc_updi_pin, (parity&1)) ;
+    deadline_wait(loc_bit_ns);
+    /* Send 2 stop bit */
+    gpio_write (loc_updi_pin, 1) ;
+    deadline_wait(TX_STOP_BITS*loc_bit_ns);
+
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Receive data from physical interface to data buffer
+ *
+ * @param [out] data Data buffer to write data in
+ * @param [in] len Length of data to be received
+ * @return num of rx bytes.
+ *
+ * @details
+ * TODO parity and stop bits check
+ *
+ */
+static int gpio_receive(uint8_t *data, uint16_t len)
+{
+  uint8_t  *pt=data;
+  int64_t  timeout;
+  int      rxlen = 0;
+  int      bit;
+  uint8_t  rxbit,byte;
+
+#ifdef DEBUG_PIN
+  gpio_write (loc_debug_pin, 1) ;
+#endif
+
+  gpio_mode (loc_updi_pin, INPUT) ;
+
+  for (rxlen=0;rxlen<len;rxlen++) {
+    /* wait start bit, spinning so the edge is not missed by a sleep */
+    timeout = now_ns() + RX_START_BIT_TIMEOUT * loc_bit_ns / 8;
+    while (gpio_read(loc_updi_pin)) {
+        if (now_ns() > timeout)
+          return rxlen;
+    }
+    /* start bit detected */
+#ifdef DEBUG_PIN
+    gpio_write (loc_debug_pin, 0) ;
+#endif
+    /* sample points are in the middle of the bits */
+    deadline_start(0);
+    deadline_wait(loc_bit_ns/2);
+
+    /* load byte */
+    byte = 0;
+    for (bit=0;bit<8;bit++) {
+      deadline_wait(loc_bit_ns);
+#ifdef DEBUG_PIN
+      gpio_write (loc_debug_pin, 1) ;
+#endif
+      rxbit = (gpio_read(loc_updi_pin))?0x80:0x00;
+      byte = (byte>>1) | rxbit;
+#ifdef DEBUG_PIN
+      gpio_write (loc_debug_pin, 0) ;
+#endif
+    }
+    /* save received byte */
+    *pt = byte & 0xff;
+    pt++;
+
+    /* skip parity, sit in the first stop bit */
+    deadline_wait(2*loc_bit_ns);
+#ifdef DEBUG_PIN
+    gpio_write (loc_debug_pin, 1) ;
+#endif
+}
+#ifdef DEBUG_PIN
+  gpio_write (loc_debug_pin, 0) ;
+#endif
+
+  return rxlen;
+}
+
+/** \brief Close physical interface
+ *
+ * \return Nothing
+ *
+ */
+static void gpio_close(void)
+{
+  jitterStats *j = &loc_jitter;
+
+  if (j->count)
+    printf("GPIO PHY jitter: %llu bits, late min %lld avg %lld max %lld ns, "
+      "%llu over 1/4 bit\n", (unsigned long long)j->count,
+      (long long)j->min_ns, (long long)(j->total_ns / (int64_t)j->count),
+      (long long)j->max_ns, (unsigned long long)j->late);
+
+  /* release tx pin */
+  if (loc_updi_pin != -1) {
+    gpio_mode (loc_updi_pin, INPUT) ;
+    loc_updi_pin = -1;
+  }
+#ifdef DEBUG_PIN
+  /* release rx pin */
+  if (loc_debug_pin != -1) {
+    gpio_mode (loc_debug_pin, INPUT) ;
+    loc_debug_pin = -1;
+  }
+#endif
+  if (loc_gpio) {
+    munmap((void *)loc_gpio, GPIOMEM_SIZE);
+    loc_gpio = NULL;
+  }
+}
+
+const phyOps phy_gpio = {
+  .name = "gpio",
+  .init = gpio_init,
+  .double_break = gpio_double_break,
+  .send = gpio_send,
+  .receive = gpio_receive,
+  .close = gpio_close,
+};
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include "phy.h"
+#include "updi.h"
+
+/*
+ * Serial port PHY: the UPDI line is the TX/RX tie of a UART (TX through a
+ * resistor, RX directly on UPDI). Frames are 8E2 as UPDI expects, and every
+ * sent byte is read back from RX, since the line is shared.
+ */
+
+static int loc_fd=-1;
+static speed_t loc_speed;
+
+#define BREAK_BAUDRATE        B300
+#define RX_TIMEOUT_MS         200
+
+/**
+ * @brief Map a baudrate to a termios speed
+ * @param [in] baudrate bit/s
+ * @return speed or 0 if not supported
+ */
+static speed_t uart_speed(uint32_t baudrate)
+{
+  switch (baudrate) {
+    case 9600:    return B9600;
+    case 19200:   return B19200;
+    case 38400:   return B38400;
+    case 57600:   return B57600;
+    case 115200:  return B115200;
+    case 230400:  return B230400;
+#ifdef B460800
+    case 460800:  return B460800;
+#endif
+#ifdef B500000
+    case 500000:  return B500000;
+#endif
+    default:      return 0;
+  }
+}
+
+/**
+ * @brief Program the port as 8E2 raw at the given speed
+ * @param [in] speed termios speed
+ * @return 0 if success
+ */
+static int uart_setup(speed_t speed)
+{
+  struct termios tio;
+
+  if (tcgetattr(loc_fd, &tio))
+    return -errno;
+
+  cfmakeraw(&tio);
+  tio.c_cflag &= ~(CSIZE | PARODD | CRTSCTS);
+  tio.c_cflag |= CS8 | PARENB | CSTOPB | CLOCAL | CREAD;
+  tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+
+  if (tcsetattr(loc_fd, TCSANOW, &tio))
+    return -errno;
+
+  tcflush(loc_fd, TCIOFLUSH);
+
+  return 0;
+}
+
+/**
+ * @brief Read bytes with a timeout between them
+ * @param [out] data buffer
+ * @param [in] len bytes to read
+ * @return num of rx bytes.
+ */
+static int uart_read(uint8_t *data, uint16_t len)
+{
+  struct pollfd pfd = { .fd = loc_fd, .events = POLLIN };
+  int rxlen = 0;
+  int n;
+
+  while (rxlen < len) {
+    if (poll(&pfd, 1, RX_TIMEOUT_MS) <= 0)
+      break;
+    n = read(loc_fd, data + rxlen, len - rxlen);
+    if (n <= 0)
+      break;
+    rxlen += n;
+  }
+
+  return rxlen;
+}
+
+/**
+ * @brief Initialize physical interface
+ *
+ * @param [in] updi programmer parameters, port and baudrate are used
+ * @return 0 if success
+ *
+ */
+static int uart_init(updiParam *updi)
+{
+  int err;
+
+  loc_speed = uart_speed(updi->baudrate);
+  if (!loc_speed) {
+    printf("Unsupported baudrate %u\n", updi->baudrate);
+    return -EINVAL;
+  }
+
+  loc_fd = open(updi->port, O_RDWR | O_NOCTTY);
+  if (loc_fd < 0) {
+    err = -errno;
+    printf("Cannot open %s\n", updi->port);
+    return err;
+  }
+
+  err = uart_setup(loc_speed);
+  if (err) {
+    close(loc_fd);
+    loc_fd = -1;
+  }
+
+  return err;
+}
+
+/**
+ * @brief Sends a double break to reset the UPDI port
+ * @param none
+ * @return 0 on success
+ * @details A 0x00 byte at 300 baud holds the line low for 33ms, longer than
+ * a BREAK at any UPDI speed.
+ *
+ */
+static int uart_double_break(void)
+{
+  uint8_t zero[2] = {0x00, 0x00};
+  int err;
+
+  if (loc_fd == -1)
+    return -EIO;
+
+  err = uart_setup(BREAK_BAUDRATE);
+  if (err)
+    return err;
+
+  if (write(loc_fd, zero, sizeof(zero)) != sizeof(zero))
+    return -EIO;
+  tcdrain(loc_fd);
+  usleep(10000);
+
+  return uart_setup(loc_speed);
+}
+
+/** \brief Send data to physical interface
+ *
+ * \param [in] data Buffer with data
+ * \param [in] len Length of data buffer
+ * \return 0 if success
+ *
+ * \details The echo of the data is read back and checked, a mismatch means
+ * the target drove the line at the same time.
+ *
+ */
+static int uart_send(uint8_t *data, uint8_t len)
+{
+  uint8_t echo[256];
+
+  if (loc_fd == -1)
+    return -EIO;
+
+  if (write(loc_fd, data, len) != len)
+    return -EIO;
+  tcdrain(loc_fd);
+
+  if (uart_read(echo, len) != len || memcmp(echo, data, len))
+    return -EIO;
+
+  return 0;
+}
+
+/**
+ * @brief Receive data from physical interface to data buffer
+ *
+ * @param [out] data Data buffer to write data in
+ * @param [in] len Length of data to be received
+ * @return num of rx bytes.
+ *
+ */
+static int uart_receive(uint8_t *data, uint16_t len)
+{
+  if (loc_fd == -1)
+    return 0;
+
+  return uart_read(data, len);
+}
+
+/** \brief Close physical interface
+ *
+ * \return Nothing
+ *
+ */
+static void uart_close(void)
+{
+  if (loc_fd != -1) {
+    close(loc_fd);
+    loc_fd = -1;
+  }
+}
+
+const phyOps phy_uart = {
+  .name = "uart",
+  .init = uart_init,
+  .double_break = uart_double_break,
+  .send = uart_send,
+  .receive = uart_receive,
+  .close = uart_close,
+};
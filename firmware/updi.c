@@ -7,8 +7,11 @@
  * The firmware is downloaded throght a single wire connection using the
  * raspberry GPIO24.
  * The main problem remain the fact that the trasmission media is a single wire
- * and serialization is made by software, this mean that the speed is very slow
- * to avoid problems in jitter on data.
+ * and serialization is made by software: every bit has an absolute deadline
+ * and the programmer runs SCHED_FIFO, locked in memory and pinned to a CPU,
+ * the per-bit jitter is reported at the end.
+ * With -d the UPDI line is driven by a serial port instead (TX/RX tie on the
+ * UPDI pad, see README.md), at PHY_BAUDRATE or the -b baudrate.
  */
 
 #include <stdio.h>
@@ -18,6 +21,7 @@
 #include <stdbool.h>
 #include <limits.h>
 #include <unistd.h>
+#include <getopt.h>
 #include "updi.h"
 #include "link.h"
 #include "nvm.h"
@@ -29,6 +33,21 @@
 #define ENABLE_ERASE
 #define ENABLE_WRITE
 
+static void usage(char *name)
+{
+  printf("usage: %s [-d serial_port] [-b baudrate] [-f hexfile] [-a] [-g cycles] [-i] [-u] [-c] [-p phases]\n", name);
+  printf("  -d  drive UPDI with a serial port (default GPIO bit-bang)\n");
+  printf("  -b  baudrate (default 1000 on GPIO, %d on serial port)\n", PHY_BAUDRATE);
+  printf("  -f  firmware file (default sd151.hex)\n");
+  printf("  -a  acknowledge every byte of a page (default burst load)\n");
+  printf("  -g  guard time in bits before the target answers, 2 to 128 (default 128)\n");
+  printf("  -i  target inserts an inter-byte delay in its responses\n");
+  printf("  -u  rewrite only the pages that differ from the file\n");
+  printf("  -c  verify with the on-chip CRC scanner instead of reading back\n");
+  printf("  -p  phases to run: e(rase) b(lank check) w(rite) v(erify), default ebwv;\n");
+  printf("      without e every page is erased as it is written\n");
+}
+
 /**
  * @brief Main application function
  * @param [in] argc Number of command line arguments
@@ -40,6 +59,10 @@ int main(int argc, char* argv[])
   updiParam priv;
   int       err=0;
   uid_t     uid=getuid();
+  int       opt;
+  uint32_t  baudrate=0;
+  unsigned  cycles;
+  char      *pt;
 
   if (uid!=0) {
     printf("\n\nThis program must be run with sudo\n\n");
@@ -48,7 +71,7 @@ int main(int argc, char* argv[])
 
   memset(&priv, 0, sizeof(updiParam));
 
-  priv.updi_pin = 5;
+  priv.updi_pin = 24;                   /* BCM GPIO */
   priv.baudrate = 1000;
   /* ATTiny817 setting */
   priv.flash_start = 0x8000;
@@ -60,54 +83,162 @@ int main(int argc, char* argv[])
   priv.fuses_address = 0x1280;
   priv.number_of_fuses = 9;
   priv.userrow_address = 0x1300;
+  priv.crcscan_address = 0x0120;
+
+  priv.burst = true;
+  priv.gtval = UPDI_CTRLA_GTVAL_128;
+  priv.phases = PHASE_ALL;
 
   strcpy(priv.filename, "sd151.hex");
 
+  while ((opt = getopt(argc, argv, "d:b:f:ag:iucp:h")) != -1) {
+    switch (opt) {
+      case 'd':
+        snprintf(priv.port, sizeof(priv.port), "%s", optarg);
+        break;
+      case 'b':
+        baudrate = strtoul(optarg, NULL, 0);
+        break;
+      case 'f':
+        snprintf(priv.filename, sizeof(priv.filename), "%s", optarg);
+        break;
+      case 'a':
+        priv.burst = false;
+        break;
+      case 'g':
+        /* GTVAL 0 is 128 cycles, every step halves it down to 2 */
+        cycles = strtoul(optarg, NULL, 0);
+        priv.gtval = UPDI_CTRLA_GTVAL_2;
+        while (priv.gtval > UPDI_CTRLA_GTVAL_128 && (128u >> priv.gtval) < cycles)
+          priv.gtval--;
+        break;
+      case 'i':
+        priv.ibdly = true;
+        break;
+      case 'u':
+        priv.update = true;
+        break;
+      case 'c':
+        priv.crc_verify = true;
+        break;
+      case 'p':
+        priv.phases = 0;
+        for (pt = optarg; *pt; pt++) {
+          switch (*pt) {
+            case 'e': priv.phases |= PHASE_ERASE; break;
+            case 'b': priv.phases |= PHASE_BLANKCHECK; break;
+            case 'w': priv.phases |= PHASE_WRITE; break;
+            case 'v': priv.phases |= PHASE_VERIFY; break;
+            default:
+              usage(argv[0]);
+              return 1;
+          }
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (baudrate)
+    priv.baudrate = baudrate;
+  else if (priv.port[0])
+    priv.baudrate = PHY_BAUDRATE;
+
+  LINK_Config(priv.gtval, priv.ibdly);
+
   //Create a UPDI physical connection
   err=PHY_Init(&priv);
   if (err) {
     printf("ERROR! Cannot initialize PHY err=%x",err);
-    return err;
+    goto err_close;
   }
+  if (priv.port[0])
+    printf("UPDI on %s at %u baud\n", priv.port, priv.baudrate);
 
   printf ("Updi programmer parsing file: '%s'\n",priv.filename) ;
   err = ParseHEXFile(&priv);
   if (err) {
     printf("ERROR! Cannot parse file err=%d\n",err);
-    return err;
+    goto err_close;
   }
   printf("done! Loaded %d bytes\n",priv.flash_max_used);
 
+  if (priv.crc_verify && FlashAddChecksum(&priv)) {
+    printf("No room for the checksum, verify by reading back\n");
+    priv.crc_verify = false;
+  }
+
+  if (priv.update) {
+    err = FlashUpdate(&priv);
+    if (err < 0) {
+      printf("Cannot update Flash err=%d\n",err);
+      err = -1;
+      goto err_close;
+    }
+    if (err)
+      printf("Updated %d pages, verified\n",err);
+    else
+      printf("Flash already up to date\n");
+
+    LeaveProgmode();
+    PHY_Close();
+    return 0;
+  }
+
 #ifdef ENABLE_ERASE
-  printf("Wait erase .... be patient\n");
-  if (ChipErase(&priv)) {
-    printf("ERROR! Cannot erase Flash.\n");
-    return -1;
+  if (priv.phases & PHASE_ERASE) {
+    printf("Wait erase .... be patient\n");
+    if (ChipErase(&priv)) {
+      printf("ERROR! Cannot erase Flash.\n");
+      err = -1;
+      goto err_close;
+    }
   }
 
-  if (FlashBlankCheck(&priv)) {
-    printf("Flash NOT erased\n");
-    return -1;
+  if (priv.phases & PHASE_BLANKCHECK) {
+    if (FlashBlankCheck(&priv)) {
+      printf("Flash NOT erased\n");
+      err = -1;
+      goto err_close;
+    }
+    printf("Flash erased\n");
   }
-  printf("Flash erased\n");
 #endif
 
 #ifdef ENABLE_WRITE
-  err = FlashProgram(&priv);
-  if (err) {
-    printf("Cannot program Flash err=%d\n",err);
-    return -1;
+  if (priv.phases & PHASE_WRITE) {
+    err = FlashProgram(&priv);
+    if (err) {
+      printf("Cannot program Flash err=%d\n",err);
+      err = -1;
+      goto err_close;
+    }
+    if (priv.crc_verify && FlashWriteChecksum(&priv)) {
+      printf("Cannot program the checksum\n");
+      err = -1;
+      goto err_close;
+    }
+    printf("Writing terminated OK\n");
   }
-  printf("Writing terminated OK\n");
 #endif
 
 #ifdef ENABLE_VERIFY
-  err = FlashVerify(&priv);
-  if (err) {
-    printf("Verify failed!\n");
-    return -1;
+  if (priv.phases & PHASE_VERIFY) {
+    if (priv.crc_verify && FlashVerifyCRC(&priv) == 0) {
+      printf("CRC verified\n");
+      err = 0;
+    } else {
+      err = FlashVerify(&priv);
+    }
+    if (err) {
+      printf("Verify failed!\n");
+      err = -1;
+      goto err_close;
+    }
+    printf("Verifing terminated OK\n");
   }
-  printf("Verifing terminated OK\n");
 #endif
 
   LeaveProgmode();
@@ -115,4 +246,9 @@ int main(int argc, char* argv[])
   PHY_Close();
 
   return 0;
+
+err_close:
+  // PHY_Close reports the bit timing of the failed run too
+  PHY_Close();
+  return err;
 }
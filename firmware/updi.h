@@ -12,6 +12,7 @@ typedef struct
   uint32_t  baudrate;
   int8_t    device;
   int       updi_pin;
+  char      port[FILENAME_LEN];
 #ifdef DEBUG_PIN
   int       debug_pin;
 #endif
@@ -28,8 +29,22 @@ typedef struct
   uint16_t  fuses_address;
   uint16_t  userrow_address;
   uint8_t   number_of_fuses;
+  bool      burst;
+  uint8_t   gtval;
+  bool      ibdly;
+  bool      update;
+  bool      crc_verify;
+  uint16_t  crcscan_address;
+  uint8_t   phases;
 } updiParam;
 
+// Programming phases, updiParam.phases
+#define PHASE_ERASE       0x01
+#define PHASE_BLANKCHECK  0x02
+#define PHASE_WRITE       0x04
+#define PHASE_VERIFY      0x08
+#define PHASE_ALL         (PHASE_ERASE | PHASE_BLANKCHECK | PHASE_WRITE | PHASE_VERIFY)
+
 // UPDI commands and control definitions
 #define UPDI_BREAK        0x00
 
@@ -82,6 +97,10 @@ typedef struct
 #define UPDI_ASI_CRC_STATUS   0x0C
 
 #define UPDI_CTRLA_IBDLY_BIT      7
+#define UPDI_CTRLA_RSD_BIT        3
+#define UPDI_CTRLA_GTVAL_MASK     0x07
+#define UPDI_CTRLA_GTVAL_128      0x00
+#define UPDI_CTRLA_GTVAL_2        0x06
 #define UPDI_CTRLB_CCDETDIS_BIT   3
 #define UPDI_CTRLB_UPDIDIS_BIT    2
 
@@ -130,4 +149,15 @@ typedef struct
 
 #define UPDI_SIB_LENGTH               16
 
+// CRC SCANNER
+#define UPDI_CRCSCAN_CTRLA      0x00
+#define UPDI_CRCSCAN_CTRLB      0x01
+#define UPDI_CRCSCAN_STATUS     0x02
+
+#define UPDI_CRCSCAN_CTRLA_RESET_BIT    7
+#define UPDI_CRCSCAN_CTRLA_ENABLE_BIT   0
+#define UPDI_CRCSCAN_CTRLB_SRC_FLASH    0x00
+#define UPDI_CRCSCAN_STATUS_OK_BIT      1
+#define UPDI_CRCSCAN_STATUS_BUSY_BIT    0
+
 #endif
@@ -0,0 +1,109 @@
+#!/bin/bash
+#
+# Find the fastest reliable I2C clock for the SD151 link.
+#
+# usage: sudo ./sd151-i2c-tune.sh [-n transfers] [-a] [rate ...]
+#
+# For every rate (default 100000 200000 400000 1000000) the i2c1 clock is
+# changed at runtime, the controller is rebound so the SD151 driver probes
+# again, and the driver self-test runs a read/verify burst on the chip ID
+# and version registers. The fastest rate without errors is reported and,
+# with -a, stored into /boot/config.txt as the i2c_baudrate overlay
+# parameter.
+#
+# The watchdog must not be running: the driver is unbound at every step.
+
+count=2000
+apply=false
+
+while getopts "n:a" opt; do
+	case $opt in
+		n) count=$OPTARG ;;
+		a) apply=true ;;
+		*) echo "usage: $0 [-n transfers] [-a] [rate ...]"; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+rates=${@:-100000 200000 400000 1000000}
+
+ctrl=$(basename $(readlink -f /sys/class/i2c-adapter/i2c-1/device))
+drv=$(basename $(readlink -f /sys/class/i2c-adapter/i2c-1/device/driver))
+
+if [ -z "$ctrl" ] || [ -z "$drv" ]; then
+	echo "i2c-1 controller not found"
+	exit 1
+fi
+
+function set_rate {
+	dtparam i2c_arm_baudrate=$1 || return 1
+	echo $ctrl > /sys/bus/platform/drivers/$drv/unbind
+	echo $ctrl > /sys/bus/platform/drivers/$drv/bind
+	# wait for the SD151 to probe again
+	for i in $(seq 20); do
+		[ -e /proc/sd151 ] && return 0
+		sleep 0.25
+	done
+	return 1
+}
+
+# selftest <rate>: prints "<errors> <bad> <avg_us> <max_us>"
+function selftest {
+	echo "selftest $count" > /proc/sd151 2>/dev/null
+	report=$(cat /proc/sd151)
+	st=$(echo "$report" | grep "^selftest    :")
+	lat=$(echo "$report" | grep "^selftest lat:")
+	errors=$(echo "$st" | sed -n 's/.* \([0-9]*\) errors.*/\1/p')
+	bad=$(echo "$st" | sed -n 's/.* \([0-9]*\) bad values.*/\1/p')
+	avg=$(echo "$lat" | sed -n 's/.*avg \([0-9]*\).*/\1/p')
+	max=$(echo "$lat" | sed -n 's/.*max \([0-9]*\).*/\1/p')
+	echo "${errors:-$count} ${bad:-0} ${avg:-0} ${max:-0}"
+}
+
+# The SD151 watchdog is the one whose parent device is named sd151
+for w in /sys/class/watchdog/watchdog*; do
+	[ "$(cat $w/device/name 2>/dev/null)" = "sd151" ] && wdog=$w
+done
+
+if [ -n "$wdog" ] && { grep -qx "active" $wdog/state 2>/dev/null ||
+		grep -q "wdog        : enabled" /proc/sd151; }; then
+	echo "SD151 watchdog /dev/$(basename $wdog) is running: stop it before tuning"
+	exit 1
+fi
+
+orig=$(grep "^i2c clock" /proc/sd151 | sed -n 's/.*: \([0-9]*\) Hz/\1/p')
+best=""
+
+printf "%10s %8s %8s %8s %8s\n" "rate" "errors" "bad" "avg_us" "max_us"
+for rate in $rates; do
+	if ! set_rate $rate; then
+		printf "%10s  driver did not probe\n" $rate
+		continue
+	fi
+	read errors bad avg max <<< $(selftest)
+	printf "%10s %8s %8s %8s %8s\n" $rate $errors $bad $avg $max
+	if [ "$errors" = "0" ] && [ "$bad" = "0" ]; then
+		if [ -z "$best" ] || [ $rate -gt $best ]; then
+			best=$rate
+		fi
+	fi
+done
+
+if [ -z "$best" ]; then
+	echo "no reliable rate found, restoring ${orig:-100000}"
+	set_rate ${orig:-100000}
+	exit 1
+fi
+
+echo "fastest reliable rate: $best"
+set_rate $best
+
+if [ "$apply" = true ]; then
+	# Only the i2c_baudrate parameter changes, the others are kept
+	if grep -q "^dtoverlay=sd151-hwmon.*i2c_baudrate=" /boot/config.txt; then
+		sed -i "/^dtoverlay=sd151-hwmon/s/i2c_baudrate=[0-9]*/i2c_baudrate=$best/" /boot/config.txt
+	else
+		sed -i "/^dtoverlay=sd151-hwmon/s/\$/,i2c_baudrate=$best/" /boot/config.txt
+	fi
+	echo "/boot/config.txt updated"
+fi
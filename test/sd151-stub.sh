@@ -0,0 +1,97 @@
+#!/bin/bash
+#
+# Bind sd151-hwmon to its software register model and measure the bus
+# transactions of every user interface. No PI-POW HAT needed.
+#
+# usage: sudo ./sd151-stub.sh [latency_us] [error_every] [loops]
+#
+# The module must be built first in the test configuration (make -C ../build test).
+
+latency=${1:-0}
+error_every=${2:-0}
+loops=${3:-100}
+
+module="../build/sd151-hwmon.ko"
+dbg="/sys/kernel/debug/sd151"
+
+function cleanup {
+	if [ -n "$bus" ]; then
+		echo 0x35 > /sys/bus/i2c/devices/i2c-$bus/delete_device 2>/dev/null
+	fi
+	rmmod sd151-hwmon 2>/dev/null
+	rmmod i2c-stub 2>/dev/null
+}
+
+# xfers per operation: measure <name> <command>
+function measure {
+	echo 0 > $dbg/xfers
+	echo 0 > $dbg/errors
+	start=$(date +%s%N)
+	for ((i = 0; i < loops; i++)); do
+		eval "$2" > /dev/null 2>&1
+	done
+	stop=$(date +%s%N)
+	xfers=$(cat $dbg/xfers)
+	errors=$(cat $dbg/errors)
+	printf "%-14s %8.2f xfers/op %10d us/op %6d errors\n" "$1" \
+		$(echo "$xfers / $loops" | bc -l) $(( (stop - start) / 1000 / loops )) $errors
+}
+
+if [ ! -f $module ]; then
+	echo "$module not found: build the module first"
+	exit 1
+fi
+
+if ! modinfo -p $module | grep -q "^stub:"; then
+	echo "$module has no register model: build it with make test"
+	exit 1
+fi
+
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+
+cleanup
+trap cleanup EXIT
+
+modprobe i2c-stub chip_addr=0x35 || exit 1
+insmod $module stub=1 stub_latency_us=$latency stub_error_every=$error_every || exit 1
+
+bus=$(i2cdetect -l | grep "SMBus stub" | head -1 | cut -f1 | cut -d- -f2)
+if [ -z "$bus" ]; then
+	echo "i2c-stub adapter not found"
+	exit 1
+fi
+
+echo sd151 0x35 > /sys/bus/i2c/devices/i2c-$bus/new_device
+sleep 1
+
+dev="/sys/bus/i2c/devices/$bus-0035"
+hwmon=$(ls -d $dev/hwmon/hwmon* | head -1)
+rtc=$(ls -d $dev/rtc/rtc* 2>/dev/null | head -1)
+wdog=$(ls $dev/watchdog 2>/dev/null | head -1)
+
+echo "register model on i2c-$bus, latency ${latency}us, error every $error_every, $loops loops"
+
+measure "hwmon in1" "cat $hwmon/in1_input"
+measure "hwmon min/max" "cat $hwmon/in1_min $hwmon/in1_max"
+measure "proc" "cat /proc/sd151"
+if [ -n "$rtc" ]; then
+	measure "rtc read" "cat $rtc/since_epoch"
+	measure "rtc alarm" "cat $rtc/wakealarm"
+fi
+if [ -n "$wdog" ]; then
+	# open (start), one keepalive write, magic close (stop)
+	measure "wdog cycle" "echo V > /dev/$wdog"
+fi
+
+# Firmware reset: the driver must notice it and replay the configuration
+resets=$(grep "^fw resets" /proc/sd151 | sed -n 's/.*: \([0-9]*\),.*/\1/p')
+if [ -n "$resets" ] && [ -e $dbg/mcu_reset ]; then
+	echo 1 > $dbg/mcu_reset
+	# detected within reset_check_ms (default 5 s)
+	for i in $(seq 60); do
+		now=$(grep "^fw resets" /proc/sd151 | sed -n 's/.*: \([0-9]*\),.*/\1/p')
+		[ "$now" != "$resets" ] && break
+		sleep 0.1
+	done
+	grep "^fw resets" /proc/sd151
+fi
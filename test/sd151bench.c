@@ -0,0 +1,459 @@
+/*
+ * sd151bench - latency and throughput of the sd151-hwmon user interfaces
+ *
+ * Every selected target is measured single threaded and, with -t N, again
+ * with N concurrent readers. Each operation is one read of a hwmon
+ * attribute, one read of /proc/sd151, one RTC_RD_TIME or one
+ * WDIOC_KEEPALIVE. I2C transactions per operation are taken from the
+ * debugfs counters of the driver register model when they are present,
+ * otherwise from the bus counters of /proc/sd151 on real hardware.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/watchdog.h>
+#include <linux/rtc.h>
+
+#define DEFAULT_COUNT		1000
+#define MAX_THREADS		64
+#define MAX_FILES		9
+#define XFERS_FILE		"/sys/kernel/debug/sd151/xfers"
+#define PROC_FILE		"/proc/sd151"
+
+static const char sopts[] = "n:t:T:r:w:Jh";
+static const struct option lopts[] = {
+	{"count",         required_argument, NULL, 'n'},
+	{"threads",       required_argument, NULL, 't'},
+	{"targets",       required_argument, NULL, 'T'},
+	{"rtc",           required_argument, NULL, 'r'},
+	{"watchdog",      required_argument, NULL, 'w'},
+	{"json",                no_argument, NULL, 'J'},
+	{"help",                no_argument, NULL, 'h'},
+	{NULL,                  no_argument, NULL, 0x0}
+};
+
+enum target_type {
+	TARGET_FILE,
+	TARGET_RTC,
+	TARGET_WDOG,
+};
+
+struct target {
+	const char *name;
+	enum target_type type;
+	int fd[MAX_FILES];
+	int nfd;
+};
+
+struct worker {
+	pthread_t thread;
+	struct target *t;
+	unsigned long count;
+	unsigned long *lat;
+	unsigned long nlat;
+	unsigned long errors;
+};
+
+struct result {
+	const char *name;
+	int threads;
+	unsigned long ops;
+	unsigned long errors;
+	double ops_per_s;
+	double xfers_per_op;
+	unsigned long min, avg, p50, p90, p99, p999, max;
+};
+
+static int json;
+static int first_result = 1;
+/* Transactions of reading the counters themselves */
+static long long xfers_overhead;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long long max_ll(long long a, long long b)
+{
+	return a > b ? a : b;
+}
+
+/* Sum of the "bus <class>: N xfers" lines of /proc/sd151, -1 if none */
+static long long read_proc_xfers(void)
+{
+	char buf[8192];
+	char *line, *save, *sep;
+	unsigned long long x;
+	long long sum = -1;
+	int f = open(PROC_FILE, O_RDONLY);
+	int n;
+
+	if (f < 0)
+		return -1;
+	n = read(f, buf, sizeof(buf) - 1);
+	close(f);
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+
+	for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		sep = strchr(line, ':');
+		if (strncmp(line, "bus ", 4) || !sep ||
+		    sscanf(sep + 1, "%llu xfers", &x) != 1)
+			continue;
+		sum = (sum < 0 ? 0 : sum) + x;
+	}
+
+	return sum;
+}
+
+/*
+ * Transaction counter: the register model debugfs counter, else the bus
+ * counters of /proc/sd151. -1 when the driver provides neither.
+ */
+static long long read_xfers(void)
+{
+	char buf[32];
+	int f = open(XFERS_FILE, O_RDONLY);
+	int n;
+
+	if (f < 0)
+		return read_proc_xfers();
+	n = read(f, buf, sizeof(buf) - 1);
+	close(f);
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+	return strtoll(buf, NULL, 0);
+}
+
+/* Reading /proc/sd151 costs transactions too: measure them once */
+static void calibrate_xfers(void)
+{
+	long long x0 = read_xfers();
+	long long x1 = read_xfers();
+
+	xfers_overhead = (x0 >= 0 && x1 > x0) ? x1 - x0 : 0;
+}
+
+static int find_hwmon(char *hwmon, size_t size)
+{
+	char path[512];
+	char name[64];
+	struct dirent *de;
+	DIR *d;
+	int f, n, found = 0;
+
+	d = opendir("/sys/class/hwmon");
+	while (d && !found && (de = readdir(d))) {
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s/name", de->d_name);
+		f = open(path, O_RDONLY);
+		if (f < 0)
+			continue;
+		n = read(f, name, sizeof(name) - 1);
+		close(f);
+		if (n > 0 && !strncmp(name, "sd151", 5)) {
+			snprintf(hwmon, size, "/sys/class/hwmon/%s", de->d_name);
+			found = 1;
+		}
+	}
+	if (d)
+		closedir(d);
+
+	return found;
+}
+
+/* Files are opened once and re-read at offset 0, the show runs every time */
+static int target_open_hwmon(struct target *t, const char *hwmon,
+			     const char *const *attrs)
+{
+	char path[512];
+	int i, j;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; attrs[j] && t->nfd < MAX_FILES; j++) {
+			snprintf(path, sizeof(path), "%s/in%d_%s", hwmon, i, attrs[j]);
+			t->fd[t->nfd] = open(path, O_RDONLY);
+			if (t->fd[t->nfd] >= 0)
+				t->nfd++;
+		}
+	}
+
+	return t->nfd ? 0 : -1;
+}
+
+static int target_op(struct target *t, unsigned long i)
+{
+	char buf[2048];
+	struct rtc_time tm;
+	int dummy;
+
+	switch (t->type) {
+	case TARGET_RTC:
+		return ioctl(t->fd[0], RTC_RD_TIME, &tm);
+	case TARGET_WDOG:
+		return ioctl(t->fd[0], WDIOC_KEEPALIVE, &dummy);
+	default:
+		return pread(t->fd[i % t->nfd], buf, sizeof(buf), 0) < 0 ? -1 : 0;
+	}
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long long t0;
+	unsigned long i;
+
+	w->lat = malloc(w->count * sizeof(*w->lat));
+	if (!w->lat)
+		return NULL;
+
+	for (i = 0; i < w->count; i++) {
+		t0 = now_ns();
+		if (target_op(w->t, i)) {
+			w->errors++;
+			continue;
+		}
+		w->lat[w->nlat++] = (now_ns() - t0) / 1000;
+	}
+
+	return NULL;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static unsigned long percentile(unsigned long *lat, unsigned long n,
+				unsigned int permille)
+{
+	unsigned long idx;
+
+	if (!n)
+		return 0;
+	idx = (n * permille + 999) / 1000;
+	return lat[idx ? idx - 1 : 0];
+}
+
+static void report(struct result *r)
+{
+	if (json) {
+		printf("%s{\"target\":\"%s\",\"threads\":%d,\"ops\":%lu,"
+		       "\"errors\":%lu,\"ops_per_s\":%.1f,",
+		       first_result ? "" : ",\n", r->name, r->threads, r->ops,
+		       r->errors, r->ops_per_s);
+		if (r->xfers_per_op >= 0)
+			printf("\"xfers_per_op\":%.3f,", r->xfers_per_op);
+		else
+			printf("\"xfers_per_op\":null,");
+		printf("\"latency_us\":{\"min\":%lu,\"avg\":%lu,\"p50\":%lu,"
+		       "\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}",
+		       r->min, r->avg, r->p50, r->p90, r->p99, r->p999, r->max);
+		first_result = 0;
+		return;
+	}
+
+	printf("%-8s threads=%-2d ops=%lu errors=%lu ops/s=%.1f", r->name,
+	       r->threads, r->ops, r->errors, r->ops_per_s);
+	if (r->xfers_per_op >= 0)
+		printf(" xfers/op=%.3f", r->xfers_per_op);
+	printf("\n         latency_us min=%lu avg=%lu p50=%lu p90=%lu p99=%lu"
+	       " p99.9=%lu max=%lu\n", r->min, r->avg, r->p50, r->p90, r->p99,
+	       r->p999, r->max);
+}
+
+static void bench_target(struct target *t, int threads, unsigned long count)
+{
+	struct worker w[MAX_THREADS];
+	struct result r;
+	unsigned long long t0, t1, sum = 0;
+	unsigned long *lat, n = 0;
+	long long x0, x1;
+	int i;
+
+	memset(w, 0, sizeof(w));
+	memset(&r, 0, sizeof(r));
+
+	x0 = read_xfers();
+	t0 = now_ns();
+	for (i = 0; i < threads; i++) {
+		w[i].t = t;
+		w[i].count = count;
+		pthread_create(&w[i].thread, NULL, worker_run, &w[i]);
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(w[i].thread, NULL);
+	t1 = now_ns();
+	x1 = read_xfers();
+
+	lat = malloc((unsigned long)threads * count * sizeof(*lat));
+	for (i = 0; i < threads; i++) {
+		if (lat && w[i].lat) {
+			memcpy(lat + n, w[i].lat, w[i].nlat * sizeof(*lat));
+			n += w[i].nlat;
+		}
+		r.errors += w[i].errors;
+		free(w[i].lat);
+	}
+	if (!lat) {
+		printf("Out of memory\n");
+		return;
+	}
+
+	qsort(lat, n, sizeof(*lat), cmp_ulong);
+	for (i = 0; (unsigned long)i < n; i++)
+		sum += lat[i];
+
+	r.name = t->name;
+	r.threads = threads;
+	r.ops = n;
+	r.ops_per_s = t1 > t0 ? n * 1e9 / (t1 - t0) : 0;
+	r.xfers_per_op = (x0 >= 0 && x1 >= 0 && n) ?
+		(double)max_ll(x1 - x0 - xfers_overhead, 0) / n : -1;
+	r.min = n ? lat[0] : 0;
+	r.avg = n ? sum / n : 0;
+	r.p50 = percentile(lat, n, 500);
+	r.p90 = percentile(lat, n, 900);
+	r.p99 = percentile(lat, n, 990);
+	r.p999 = percentile(lat, n, 999);
+	r.max = n ? lat[n - 1] : 0;
+
+	report(&r);
+	free(lat);
+}
+
+static void usage(char *progname)
+{
+	printf("Usage: %s [options]\n", progname);
+	printf(" -n, --count=N\t\tOperations per reader (default %d)\n",
+	       DEFAULT_COUNT);
+	printf(" -t, --threads=N\tAlso run with N concurrent readers (max %d)\n",
+	       MAX_THREADS);
+	printf(" -T, --targets=LIST\tinput,minmax,proc,rtc,wdog (default all but wdog)\n");
+	printf(" -r, --rtc=DEV\t\tRTC device (default /dev/rtc0)\n");
+	printf(" -w, --watchdog=DEV\tWatchdog device (default /dev/watchdog1)\n");
+	printf(" -J, --json\t\tPrint results as JSON\n");
+	printf(" -h, --help\t\tPrint the help message\n");
+	printf("\n");
+	printf("The wdog target starts the watchdog and stops it with magic close.\n");
+	printf("Example: %s -n 5000 -t 4 -T input,proc,rtc -J\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *const input_attrs[] = { "input", NULL };
+	static const char *const minmax_attrs[] = { "min", "max", NULL };
+	char *targets = "input,minmax,proc,rtc";
+	char *rtc = "/dev/rtc0";
+	char *wdog = "/dev/watchdog1";
+	unsigned long count = DEFAULT_COUNT;
+	int threads = 1;
+	char hwmon[300] = "";
+	char *list, *tok, *save;
+	struct target t;
+	int c, i, have_hwmon;
+
+	setbuf(stdout, NULL);
+
+	while ((c = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			if (!count)
+				count = DEFAULT_COUNT;
+			break;
+		case 't':
+			threads = strtoul(optarg, NULL, 0);
+			if (threads < 1)
+				threads = 1;
+			if (threads > MAX_THREADS)
+				threads = MAX_THREADS;
+			break;
+		case 'T':
+			targets = optarg;
+			break;
+		case 'r':
+			rtc = optarg;
+			break;
+		case 'w':
+			wdog = optarg;
+			break;
+		case 'J':
+			json = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+
+	have_hwmon = find_hwmon(hwmon, sizeof(hwmon));
+	calibrate_xfers();
+
+	if (json)
+		printf("[");
+
+	list = strdup(targets);
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		memset(&t, 0, sizeof(t));
+		t.name = tok;
+		t.type = TARGET_FILE;
+
+		if (!strcmp(tok, "input") || !strcmp(tok, "minmax")) {
+			if (!have_hwmon || target_open_hwmon(&t, hwmon,
+			    strcmp(tok, "input") ? minmax_attrs : input_attrs)) {
+				fprintf(stderr, "sd151 hwmon not found\n");
+				continue;
+			}
+		} else if (!strcmp(tok, "proc")) {
+			t.fd[t.nfd++] = open("/proc/sd151", O_RDONLY);
+		} else if (!strcmp(tok, "rtc")) {
+			/* RTC and watchdog devices are single open: readers share it */
+			t.type = TARGET_RTC;
+			t.fd[t.nfd++] = open(rtc, O_RDONLY);
+		} else if (!strcmp(tok, "wdog")) {
+			t.type = TARGET_WDOG;
+			t.fd[t.nfd++] = open(wdog, O_WRONLY);
+		} else {
+			fprintf(stderr, "Unknown target '%s'\n", tok);
+			continue;
+		}
+
+		if (t.fd[0] < 0) {
+			fprintf(stderr, "%s: open failed %s\n", tok, strerror(errno));
+			continue;
+		}
+
+		bench_target(&t, 1, count);
+		if (threads > 1)
+			bench_target(&t, threads, count);
+
+		if (t.type == TARGET_WDOG && write(t.fd[0], "V", 1) < 0)
+			fprintf(stderr, "Stopping watchdog failed (%d)\n", errno);
+		for (i = 0; i < t.nfd; i++)
+			close(t.fd[i]);
+	}
+	free(list);
+
+	if (json)
+		printf("]\n");
+
+	return 0;
+}
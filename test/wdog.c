@@ -6,15 +6,23 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <getopt.h>
+#include <dirent.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
 #include <linux/types.h>
 #include <linux/watchdog.h>
+#include <linux/rtc.h>
 
 #define DEFAULT_PING_RATE	1
+#define BENCH_HIST_BUCKETS	24
+#define BENCH_MAX_STRESS	64
+#define BENCH_MEM_SIZE		(64 * 1024 * 1024)
 
 int fd;
 const char v = 'V';
-static const char sopts[] = "bdehp:t:Tn:NLf:i";
+static volatile sig_atomic_t bench_stop;
+static const char sopts[] = "bdehp:t:Tn:NLf:iB:P:D:S:J";
 static const struct option lopts[] = {
 	{"bootstatus",          no_argument, NULL, 'b'},
 	{"disable",             no_argument, NULL, 'd'},
@@ -28,9 +36,33 @@ static const struct option lopts[] = {
 	{"gettimeleft",		no_argument, NULL, 'L'},
 	{"file",          required_argument, NULL, 'f'},
 	{"info",		no_argument, NULL, 'i'},
+	{"bench",         required_argument, NULL, 'B'},
+	{"period",        required_argument, NULL, 'P'},
+	{"deadline",      required_argument, NULL, 'D'},
+	{"stress",        required_argument, NULL, 'S'},
+	{"json",                no_argument, NULL, 'J'},
 	{NULL,                  no_argument, NULL, 0x0}
 };
 
+struct bench {
+	unsigned long count;
+	unsigned long period_us;
+	unsigned long deadline_us;
+	char *stress;
+	int json;
+	/* results */
+	unsigned long *lat;
+	unsigned long nlat;
+	unsigned long errors;
+	unsigned long missed;
+	unsigned long hist[BENCH_HIST_BUCKETS];
+	unsigned long jit_max;
+	unsigned long long jit_sum;
+	unsigned long long lat_sum;
+	pid_t stress_pid[BENCH_MAX_STRESS];
+	int nstress;
+};
+
 /*
  * This function simply sends an IOCTL to the driver, which in turn ticks
  * the PC Watchdog card to reset its internal timer so it doesn't trigger
@@ -46,6 +78,294 @@ static void keep_alive(void)
 		printf(".");
 }
 
+/*
+ * Benchmark mode: time every WDIOC_KEEPALIVE, schedule pings on absolute
+ * deadlines to measure the wake-up jitter, and optionally load the system
+ * with CPU, memory and SD151 I2C bus readers.
+ */
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_sigint(int sig)
+{
+	bench_stop = 1;
+}
+
+static void stress_cpu(void)
+{
+	volatile unsigned long x = 0;
+
+	for (;;)
+		x++;
+}
+
+static void stress_mem(void)
+{
+	char *buf = malloc(BENCH_MEM_SIZE);
+	unsigned char c = 0;
+
+	if (!buf)
+		exit(1);
+	for (;;)
+		memset(buf, c++, BENCH_MEM_SIZE);
+}
+
+static void read_file(const char *path)
+{
+	char buf[1024];
+	int f = open(path, O_RDONLY);
+
+	if (f < 0)
+		return;
+	while (read(f, buf, sizeof(buf)) > 0)
+		;
+	close(f);
+}
+
+/* Hammer the SD151 through hwmon, RTC and /proc */
+static void stress_i2c(int which)
+{
+	char hwmon[300] = "";
+	char path[512];
+	char name[64];
+	struct dirent *de;
+	struct rtc_time tm;
+	DIR *d;
+	int f, i;
+
+	d = opendir("/sys/class/hwmon");
+	while (d && (de = readdir(d))) {
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s/name", de->d_name);
+		f = open(path, O_RDONLY);
+		if (f < 0)
+			continue;
+		i = read(f, name, sizeof(name) - 1);
+		close(f);
+		if (i > 0 && !strncmp(name, "sd151", 5)) {
+			snprintf(hwmon, sizeof(hwmon), "/sys/class/hwmon/%s", de->d_name);
+			break;
+		}
+	}
+	if (d)
+		closedir(d);
+
+	for (;;) {
+		switch (which) {
+		case 0:
+			for (i = 0; hwmon[0] && i < 3; i++) {
+				snprintf(path, sizeof(path), "%s/in%d_input", hwmon, i);
+				read_file(path);
+			}
+			break;
+		case 1:
+			f = open("/dev/rtc0", O_RDONLY);
+			if (f >= 0) {
+				ioctl(f, RTC_RD_TIME, &tm);
+				close(f);
+			}
+			break;
+		default:
+			read_file("/proc/sd151");
+			break;
+		}
+	}
+}
+
+static void stress_fork(struct bench *b, void (*fn)(int), int arg)
+{
+	pid_t pid;
+
+	if (b->nstress >= BENCH_MAX_STRESS)
+		return;
+
+	pid = fork();
+	if (pid == 0) {
+		close(fd);
+		signal(SIGINT, SIG_DFL);
+		fn(arg);
+		exit(0);
+	}
+	if (pid > 0)
+		b->stress_pid[b->nstress++] = pid;
+}
+
+static void stress_cpu_fn(int arg)
+{
+	stress_cpu();
+}
+
+static void stress_mem_fn(int arg)
+{
+	stress_mem();
+}
+
+static void stress_start(struct bench *b)
+{
+	char *list, *tok, *save;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	if (!b->stress)
+		return;
+
+	list = strdup(b->stress);
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(tok, "cpu")) {
+			for (i = 0; i < ncpu; i++)
+				stress_fork(b, stress_cpu_fn, 0);
+		} else if (!strcmp(tok, "mem")) {
+			stress_fork(b, stress_mem_fn, 0);
+		} else if (!strcmp(tok, "i2c")) {
+			for (i = 0; i < 3; i++)
+				stress_fork(b, stress_i2c, i);
+		} else {
+			printf("Unknown stress '%s' (cpu,mem,i2c)\n", tok);
+		}
+	}
+	free(list);
+}
+
+static void stress_stop(struct bench *b)
+{
+	int i;
+
+	for (i = 0; i < b->nstress; i++)
+		kill(b->stress_pid[i], SIGKILL);
+	for (i = 0; i < b->nstress; i++)
+		waitpid(b->stress_pid[i], NULL, 0);
+	b->nstress = 0;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static unsigned long percentile(struct bench *b, unsigned int pct)
+{
+	unsigned long idx;
+
+	if (!b->nlat)
+		return 0;
+	idx = (b->nlat * pct + 99) / 100;
+	return b->lat[idx ? idx - 1 : 0];
+}
+
+static void bench_report(struct bench *b)
+{
+	unsigned long avg = b->nlat ? b->lat_sum / b->nlat : 0;
+	unsigned long javg = b->nlat ? b->jit_sum / b->nlat : 0;
+	int i, last = 0;
+
+	qsort(b->lat, b->nlat, sizeof(*b->lat), cmp_ulong);
+
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++)
+		if (b->hist[i])
+			last = i;
+
+	if (b->json) {
+		printf("{\"samples\":%lu,\"errors\":%lu,\"period_us\":%lu,"
+		       "\"deadline_us\":%lu,\"missed\":%lu,\"stress\":\"%s\",",
+		       b->nlat, b->errors, b->period_us, b->deadline_us,
+		       b->missed, b->stress ? b->stress : "");
+		printf("\"latency_us\":{\"min\":%lu,\"avg\":%lu,\"p50\":%lu,"
+		       "\"p99\":%lu,\"max\":%lu},",
+		       b->nlat ? b->lat[0] : 0, avg, percentile(b, 50),
+		       percentile(b, 99), b->nlat ? b->lat[b->nlat - 1] : 0);
+		printf("\"jitter_us\":{\"avg\":%lu,\"max\":%lu},", javg, b->jit_max);
+		printf("\"histogram\":[");
+		for (i = 0; i <= last; i++)
+			printf("%s{\"le_us\":%lu,\"count\":%lu}", i ? "," : "",
+			       1UL << i, b->hist[i]);
+		printf("]}\n");
+		return;
+	}
+
+	printf("\nsamples=%lu errors=%lu period_us=%lu deadline_us=%lu missed=%lu\n",
+	       b->nlat, b->errors, b->period_us, b->deadline_us, b->missed);
+	printf("latency_us min=%lu avg=%lu p50=%lu p99=%lu max=%lu\n",
+	       b->nlat ? b->lat[0] : 0, avg, percentile(b, 50), percentile(b, 99),
+	       b->nlat ? b->lat[b->nlat - 1] : 0);
+	printf("jitter_us avg=%lu max=%lu\n", javg, b->jit_max);
+	for (i = 0; i <= last; i++)
+		printf("hist le_us=%lu count=%lu\n", 1UL << i, b->hist[i]);
+}
+
+static void bench_run(struct bench *b)
+{
+	struct timespec next;
+	unsigned long long t0, t1, sched, prev = 0;
+	unsigned long lat, jit, size = 0, grow;
+	unsigned long *tmp;
+	int dummy, i;
+
+	if (!b->deadline_us)
+		b->deadline_us = 2 * b->period_us;
+
+	signal(SIGINT, bench_sigint);
+	stress_start(b);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	sched = (unsigned long long)next.tv_sec * 1000000000ULL + next.tv_nsec;
+
+	while (!bench_stop && (!b->count || b->nlat + b->errors < b->count)) {
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		if (bench_stop)
+			break;
+
+		t0 = now_ns();
+		if (ioctl(fd, WDIOC_KEEPALIVE, &dummy)) {
+			b->errors++;
+		} else {
+			t1 = now_ns();
+			lat = (t1 - t0) / 1000;
+			jit = t0 > sched ? (t0 - sched) / 1000 : 0;
+
+			if (b->nlat == size) {
+				/* On failure keep what was sampled and stop */
+				grow = size ? 2 * size : 1024;
+				tmp = realloc(b->lat, grow * sizeof(*b->lat));
+				if (!tmp) {
+					printf("Out of memory\n");
+					break;
+				}
+				b->lat = tmp;
+				size = grow;
+			}
+			b->lat[b->nlat++] = lat;
+			b->lat_sum += lat;
+			b->jit_sum += jit;
+			if (jit > b->jit_max)
+				b->jit_max = jit;
+			for (i = 0; i < BENCH_HIST_BUCKETS - 1 && (1UL << i) < lat; i++)
+				;
+			b->hist[i]++;
+			/* Keepalive completed too late after the previous one */
+			if (prev && (t1 - prev) / 1000 > b->deadline_us)
+				b->missed++;
+			prev = t1;
+			if (!b->json)
+				printf(".");
+		}
+
+		sched += b->period_us * 1000ULL;
+		next.tv_sec = sched / 1000000000ULL;
+		next.tv_nsec = sched % 1000000000ULL;
+	}
+
+	stress_stop(b);
+	bench_report(b);
+	free(b->lat);
+}
+
 /*
  * The main program.  Run the program with "-d" to disable the card,
  * or "-e" to enable the card.
@@ -80,10 +400,16 @@ static void usage(char *progname)
 	printf(" -n, --pretimeout=T\tSet the pretimeout to T seconds\n");
 	printf(" -N, --getpretimeout\tGet the pretimeout\n");
 	printf(" -L, --gettimeleft\tGet the time left until timer expires\n");
+	printf(" -B, --bench=N\t\tBenchmark N keepalives (0 until Ctrl-C)\n");
+	printf(" -P, --period=MS\tBenchmark ping period in ms (default ping rate)\n");
+	printf(" -D, --deadline=MS\tReport pings later than MS (default 2 periods)\n");
+	printf(" -S, --stress=LIST\tLoad during benchmark: cpu,mem,i2c\n");
+	printf(" -J, --json\t\tPrint benchmark results as JSON\n");
 	printf("\n");
 	printf("Parameters are parsed left-to-right in real-time.\n");
 	printf("Example: %s -d -t 10 -p 5 -e\n", progname);
 	printf("Example: %s -t 12 -T -n 7 -N\n", progname);
+	printf("Example: %s -t 30 -B 1000 -P 100 -S cpu,i2c -J\n", progname);
 }
 
 int main(int argc, char *argv[])
@@ -95,8 +421,11 @@ int main(int argc, char *argv[])
 	int oneshot = 0;
 	char *file = "/dev/watchdog1";
 	struct watchdog_info info;
+	struct bench bench;
+	int benchmark = 0;
 
 	setbuf(stdout, NULL);
+	memset(&bench, 0, sizeof(bench));
 
 	while ((c = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
 		if (c == 'f')
@@ -210,6 +539,22 @@ int main(int argc, char *argv[])
 			else
 				printf("WDIOC_GETTIMELEFT error '%s'\n", strerror(errno));
 			break;
+		case 'B':
+			benchmark = 1;
+			bench.count = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			bench.period_us = strtoul(optarg, NULL, 0) * 1000;
+			break;
+		case 'D':
+			bench.deadline_us = strtoul(optarg, NULL, 0) * 1000;
+			break;
+		case 'S':
+			bench.stress = optarg;
+			break;
+		case 'J':
+			bench.json = 1;
+			break;
 		case 'f':
 			/* Handled above */
 			break;
@@ -235,6 +580,15 @@ int main(int argc, char *argv[])
 	if (oneshot)
 		goto end;
 
+	if (benchmark) {
+		if (!bench.period_us)
+			bench.period_us = ping_rate * 1000000UL;
+		if (!bench.json)
+			printf("Watchdog benchmark running!\n");
+		bench_run(&bench);
+		goto end;
+	}
+
 	printf("Watchdog Ticking Away!\n");
 
 	signal(SIGINT, term);